@@ -1,3 +1,5 @@
+// Build: g++ -std=c++17 -O2 -pthread main.cpp -o dairy
+
 #include <iostream>
 #include <fstream>
 #include <iomanip>
@@ -6,27 +8,601 @@
 #include <sstream>
 #include <algorithm>
 #include <limits>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <cstdint>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string_view>
+#include <charconv>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <mutex>
+#include <memory>
+#include <shared_mutex>
+#include <condition_variable>
+#include <future>
+#include <csignal>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#endif
+
+#if !defined(DAIRY_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DAIRY_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
+// Arena for customer text. Each distinct value is copied once, after its
+// length, into large blocks that are never moved or freed, and a flat
+// open-addressing table finds it again, so loading costs a few block
+// allocations instead of one per field and a field is a single pointer.
+// Interning happens only on the thread that owns the store (under the store
+// lock in server mode); readers just follow the pointers.
+class TextPool {
+public:
+    const char* intern(string_view value) {
+        if (value.empty()) {
+            return nullptr;
+        }
+        if ((valueCount + 1) * 4 > slots.size() * 3) {
+            rehash(max<size_t>(1024, slots.size() * 2));
+        }
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash<string_view>()(value) & mask;; i = (i + 1) & mask) {
+            if (!slots[i]) {
+                slots[i] = store(value);
+                ++valueCount;
+                return slots[i];
+            }
+            if (view(slots[i]) == value) {
+                return slots[i];
+            }
+        }
+    }
+    
+    static string_view view(const char* value) {
+        if (!value) {
+            return string_view();
+        }
+        uint32_t length = 0;
+        int shift = 0;
+        while (uint8_t(*value) & 0x80) {
+            length |= uint32_t(uint8_t(*value++) & 0x7f) << shift;
+            shift += 7;
+        }
+        length |= uint32_t(uint8_t(*value++)) << shift;
+        return string_view(value, length);
+    }
+    
+    size_t values() const { return valueCount; }
+    size_t bytes() const { return byteCount; }
+    
+private:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+    
+    const char* store(string_view value) {
+        size_t needed = value.size() + 5;
+        char* copy;
+        if (needed > BLOCK_SIZE / 4) {
+            large.emplace_back(new char[needed]);
+            copy = large.back().get();
+        } else {
+            if (blocks.empty() || blockUsed + needed > BLOCK_SIZE) {
+                blocks.emplace_back(new char[BLOCK_SIZE]);
+                blockUsed = 0;
+            }
+            copy = blocks.back().get() + blockUsed;
+        }
+        char* out = copy;
+        uint32_t length = uint32_t(value.size());
+        while (length >= 0x80) {
+            *out++ = char(uint8_t(length) | 0x80);
+            length >>= 7;
+        }
+        *out++ = char(length);
+        memcpy(out, value.data(), value.size());
+        out += value.size();
+        if (needed <= BLOCK_SIZE / 4) {
+            blockUsed += size_t(out - copy);
+        }
+        byteCount += size_t(out - copy);
+        return copy;
+    }
+    
+    void rehash(size_t size) {
+        vector<const char*> old(size, nullptr);
+        old.swap(slots);
+        for (const char* value : old) {
+            if (value) {
+                size_t i = hash<string_view>()(view(value)) & (size - 1);
+                while (slots[i]) {
+                    i = (i + 1) & (size - 1);
+                }
+                slots[i] = value;
+            }
+        }
+    }
+    
+    vector<unique_ptr<char[]>> blocks, large;
+    size_t blockUsed = 0;
+    vector<const char*> slots;
+    size_t valueCount = 0;
+    size_t byteCount = 0;
+};
+
+TextPool customerText;
+
+// A customer text field: a pointer to an interned value in customerText.
+// Assigning any string interns it; reading gives a string_view.
+class PooledText {
+public:
+    PooledText() = default;
+    PooledText(string_view value) : text(customerText.intern(value)) {}
+    PooledText(const string& value) : PooledText(string_view(value)) {}
+    PooledText(const char* value) : PooledText(string_view(value)) {}
+    
+    operator string_view() const { return TextPool::view(text); }
+    string str() const { return string(TextPool::view(text)); }
+    size_t size() const { return TextPool::view(text).size(); }
+    bool empty() const { return text == nullptr; }
+    
+private:
+    const char* text = nullptr;
+};
+
+ostream& operator<<(ostream& out, const PooledText& value) {
+    return out << string_view(value);
+}
+
 // Structure to store customer information
 struct Customer {
     int id;
-    string name;
-    string address;
-    string phone;
+    PooledText name;
+    PooledText address;
+    PooledText phone;
     double rate; // per liter rate
 };
 
-// Structure to store daily milk entry
+// Structure to store daily milk entry. Fixed-width integers keep the record
+// small and the sums exact: quantities are in millilitres, amount in paise.
 struct MilkEntry {
-    int customerId;
-    string date;
-    double morningQty;
-    double eveningQty;
-    double totalQty;
-    double amount;
+    int32_t customerId;
+    int32_t day; // days since 01-01-1970; entries are kept sorted by it
+    int32_t morningMl;
+    int32_t eveningMl;
+    int32_t amountPaise;
+    
+    int32_t totalMl() const { return morningMl + eveningMl; }
+};
+static_assert(sizeof(MilkEntry) == 20, "MilkEntry should stay a packed 20-byte record");
+
+// Entry store laid out column by column, so report totals can filter and sum
+// contiguous arrays. Rows are handed out as MilkEntry values.
+struct EntryColumns {
+    vector<int32_t> customerId;
+    vector<int32_t> day;
+    vector<int32_t> morningMl;
+    vector<int32_t> eveningMl;
+    vector<int32_t> amountPaise;
+    
+    size_t size() const { return day.size(); }
+    bool empty() const { return day.empty(); }
+    
+    MilkEntry operator[](size_t i) const {
+        return MilkEntry{customerId[i], day[i], morningMl[i], eveningMl[i], amountPaise[i]};
+    }
+    
+    void insert(size_t pos, const MilkEntry& entry) {
+        customerId.insert(customerId.begin() + pos, entry.customerId);
+        day.insert(day.begin() + pos, entry.day);
+        morningMl.insert(morningMl.begin() + pos, entry.morningMl);
+        eveningMl.insert(eveningMl.begin() + pos, entry.eveningMl);
+        amountPaise.insert(amountPaise.begin() + pos, entry.amountPaise);
+    }
+    
+    // Inserts rows, already in day order, in front of position pos
+    void insertRows(size_t pos, const vector<MilkEntry>& rows) {
+        for (vector<int32_t>* column : {&customerId, &day, &morningMl, &eveningMl, &amountPaise}) {
+            column->insert(column->begin() + pos, rows.size(), 0);
+        }
+        for (size_t i = 0; i < rows.size(); ++i) {
+            customerId[pos + i] = rows[i].customerId;
+            day[pos + i] = rows[i].day;
+            morningMl[pos + i] = rows[i].morningMl;
+            eveningMl[pos + i] = rows[i].eveningMl;
+            amountPaise[pos + i] = rows[i].amountPaise;
+        }
+    }
+    
+    // Appends rows [first, last) of another store
+    void append(const EntryColumns& other, size_t first, size_t last) {
+        customerId.insert(customerId.end(), other.customerId.begin() + first, other.customerId.begin() + last);
+        day.insert(day.end(), other.day.begin() + first, other.day.begin() + last);
+        morningMl.insert(morningMl.end(), other.morningMl.begin() + first, other.morningMl.begin() + last);
+        eveningMl.insert(eveningMl.end(), other.eveningMl.begin() + first, other.eveningMl.begin() + last);
+        amountPaise.insert(amountPaise.end(), other.amountPaise.begin() + first, other.amountPaise.begin() + last);
+    }
+    
+    // Removes rows [first, last)
+    void erase(size_t first, size_t last) {
+        for (vector<int32_t>* column : {&customerId, &day, &morningMl, &eveningMl, &amountPaise}) {
+            column->erase(column->begin() + first, column->begin() + last);
+        }
+    }
+    
+    void assign(const vector<MilkEntry>& rows) {
+        clear();
+        reserve(rows.size());
+        for (const auto& entry : rows) {
+            insert(size(), entry);
+        }
+    }
+    
+    // Keeps the rows for which keep(row) is true, preserving their order
+    template <typename Predicate>
+    void filter(Predicate keep) {
+        size_t kept = 0;
+        for (size_t i = 0; i < size(); ++i) {
+            if (keep((*this)[i])) {
+                customerId[kept] = customerId[i];
+                day[kept] = day[i];
+                morningMl[kept] = morningMl[i];
+                eveningMl[kept] = eveningMl[i];
+                amountPaise[kept] = amountPaise[i];
+                ++kept;
+            }
+        }
+        customerId.resize(kept);
+        day.resize(kept);
+        morningMl.resize(kept);
+        eveningMl.resize(kept);
+        amountPaise.resize(kept);
+    }
+    
+    void reserve(size_t n) {
+        customerId.reserve(n);
+        day.reserve(n);
+        morningMl.reserve(n);
+        eveningMl.reserve(n);
+        amountPaise.reserve(n);
+    }
+    
+    void clear() {
+        customerId.clear();
+        day.clear();
+        morningMl.clear();
+        eveningMl.clear();
+        amountPaise.clear();
+    }
+};
+
+// One step of a customer's rate history
+struct RateChange {
+    int32_t fromDay; // effective from this day until the next change
+    double rate;
+    uint64_t seq;    // journal sequence number of the change, 0 if older than every file
+};
+
+// Result of an aggregation kernel over a slice of the entry store
+struct EntryTotals {
+    long long morningMl = 0;
+    long long eveningMl = 0;
+    long long amountPaise = 0;
+    long long count = 0;
+    
+    long long totalMl() const { return morningMl + eveningMl; }
+    
+    // Adds (sign 1) or subtracts (sign -1) another set of totals
+    void add(const EntryTotals& other, int sign = 1) {
+        morningMl += sign * other.morningMl;
+        eveningMl += sign * other.eveningMl;
+        amountPaise += sign * other.amountPaise;
+        count += sign * other.count;
+    }
+    
+    void add(const MilkEntry& entry) {
+        morningMl += entry.morningMl;
+        eveningMl += entry.eveningMl;
+        amountPaise += entry.amountPaise;
+        ++count;
+    }
+};
+
+// Totals grouped by customer and month, keyed like customerMonthRollups
+// (customer ID in the high half, month in the low half). Morning and evening
+// stay apart in EntryTotals, so the shift is part of every group.
+using GroupTotals = unordered_map<uint64_t, EntryTotals>;
+
+// A window onto a report's rows, for paging through large results: the
+// first offset rows are skipped and at most limit are shown. The report sets
+// more when rows follow the window, and where the next page starts: the month
+// of its first row and how many of that month's rows come before it, so the
+// months already shown are not read again. The report's total over all its
+// rows is worked out with the first page and kept for the others.
+struct EntryPage {
+    size_t offset = 0;
+    size_t limit = numeric_limits<size_t>::max();
+    bool more = false;
+    int resumeMonth = -1;       // -1: start offset rows in from the beginning
+    size_t resumeSkip = 0;
+    bool totaled = false;
+    EntryTotals total;
+};
+
+// Shape of a synthetic data set for benchmarks and load tests
+struct DatasetSpec {
+    int customers = 100;
+    int days = 365;
+    double deliveryRate = 0.9;  // chance a customer takes milk on a given day
+    double bothShifts = 0.6;    // share of customers taking both shifts; the rest take one
+    uint64_t seed = 1;
+    size_t maxEntries = 0;      // stop once this many entries exist (0 = no limit)
+};
+
+// One month of entries in the partitioned store (see PARTITION_DIR)
+struct Partition {
+    bool resident = false;  // its entries are in milkEntries
+    bool dirty = false;     // changed since its file was written
+    bool onDisk = false;
+    bool rolledUp = false;  // its entries are counted in the rollups
+    bool archived = false;  // its file is the packed entries/YYYY-MM.arc
+    uint64_t seq = 0;       // journal sequence number its file is consistent with
+    uint64_t lastUse = 0;
+    uint64_t version = 0;   // bumped by every change, to tell if a save is still current
+};
+
+// A copy of everything a save writes. It is taken between operations, so the
+// files can be written from it on another thread while work carries on.
+struct DataImage {
+    uint64_t journalSeq = 0;
+    int lastCustomerId = 0;
+    vector<Customer> customers;
+    unordered_map<int, vector<RateChange>> rateHistory;
+    EntryColumns entries;                       // the store, or in partition mode its changed months
+    vector<pair<int, uint64_t>> months;         // partition mode: (month, version) of those months
+    vector<int> knownMonths;                    // partition mode: every month in the store
+    int archiveBefore = numeric_limits<int>::min(); // partition mode: months before this are archived
+    unordered_set<int> deleted;                 // customers this save compacts away, left out of the above
+    vector<pair<int, bool>> compactMonths;      // partition mode: (month, archived) files that may hold them
+    vector<pair<int, bool>> compacted;          // set by the save: (month, emptied) of the files rewritten
+};
+
+// Matches every customer in sumEntries
+const int32_t ALL_CUSTOMERS = -1;
+
+const int LAST_DAY = 2932896; // 31-12-9999
+
+// Rows per page of the long menu reports
+const size_t MENU_PAGE_ROWS = 100;
+
+// Binary snapshot layout (little-endian). After the header come the customer
+// records, their text, and then the five entry columns in store order. Every
+// section is padded to 8 bytes so the whole payload can be checksummed a word
+// at a time.
+struct SnapshotHeader {
+    char magic[8];          // "DAIRYSNP"
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t journalSeq;
+    uint64_t customerCount;
+    uint64_t entryCount;
+    uint64_t textBytes;     // including padding
+    uint64_t checksum;      // over everything after the header
+};
+
+struct SnapshotCustomer {
+    int32_t id;
+    uint32_t nameLength;
+    uint32_t addressLength;
+    uint32_t phoneLength;
+    uint64_t textOffset;    // name, address and phone stored back to back
+    double rate;
+};
+
+const uint32_t SNAPSHOT_VERSION = 1;
+
+// Archive file layout for closed months (entries/YYYY-MM.arc, little-endian):
+// the header, one index record per block, then the blocks. Rows are sorted by
+// customer and date and packed as varints: the customer ID as a step from the
+// previous row, the day as a step from the customer's previous row (or from
+// the block's first day), quantities and amount zigzag-encoded. Each block is
+// padded to 8 bytes and checksummed. The index holds every block's customer
+// and day bounds, so a lookup reads only the blocks that can match.
+struct ArchiveHeader {
+    char magic[8];          // "DAIRYARC"
+    uint32_t version;
+    uint32_t blockCount;
+    uint64_t journalSeq;
+    uint64_t entryCount;
+};
+
+struct ArchiveBlock {
+    int32_t minCustomerId;
+    int32_t maxCustomerId;
+    int32_t minDay;
+    int32_t maxDay;
+    uint32_t entryCount;
+    uint32_t bytes;         // including padding
+    uint64_t offset;        // from the start of the file
+    uint64_t checksum;
+};
+
+const uint32_t ARCHIVE_VERSION = 1;
+const size_t ARCHIVE_BLOCK_ENTRIES = 1024;
+
+void appendDate(string& out, int day);
+void appendFixed(string& out, long long value, int decimals);
+
+enum Align { LEFT, RIGHT };
+
+// Report rendering. Each row is formatted once, with to_chars and no iostream
+// manipulators, into a reusable buffer that is written to every sink (screen,
+// file or both) in large blocks. Without sinks the rendered text is kept so
+// it can be written out later with writeTo().
+class ReportWriter {
+public:
+    ReportWriter() = default;
+    explicit ReportWriter(ostream& sink) { sinks.push_back(&sink); }
+    ~ReportWriter() { flush(); }
+    
+    void addSink(ostream& sink) { sinks.push_back(&sink); }
+    
+    ReportWriter& text(string_view value) {
+        buffer.append(value.data(), value.size());
+        return *this;
+    }
+    
+    ReportWriter& cell(string_view value, size_t width, Align align = LEFT) {
+        size_t start = buffer.size();
+        buffer.append(value.data(), value.size());
+        return pad(start, width, align);
+    }
+    
+    ReportWriter& cell(long long value, size_t width, Align align = LEFT) {
+        size_t start = buffer.size();
+        char digits[24];
+        buffer.append(digits, to_chars(digits, digits + sizeof(digits), value).ptr - digits);
+        return pad(start, width, align);
+    }
+    
+    // Quantity in liters with 2 decimals, rounded half away from zero
+    ReportWriter& liters(long long millilitres, size_t width, Align align = LEFT) {
+        size_t start = buffer.size();
+        appendFixed(buffer, (millilitres + (millilitres < 0 ? -5 : 5)) / 10, 2);
+        return pad(start, width, align);
+    }
+    
+    ReportWriter& rupees(long long paise, size_t width, Align align = LEFT) {
+        size_t start = buffer.size();
+        appendFixed(buffer, paise, 2);
+        return pad(start, width, align);
+    }
+    
+    // A fixed-point integer, e.g. fixedPoint(1500, 3) writes "1.500"
+    ReportWriter& fixedPoint(long long value, int decimals, size_t width, Align align = LEFT) {
+        size_t start = buffer.size();
+        appendFixed(buffer, value, decimals);
+        return pad(start, width, align);
+    }
+    
+    ReportWriter& rate(double value, size_t width, Align align = LEFT) {
+        size_t start = buffer.size();
+        char digits[48];
+        buffer.append(digits, to_chars(digits, digits + sizeof(digits), value, chars_format::fixed, 2).ptr - digits);
+        return pad(start, width, align);
+    }
+    
+    ReportWriter& date(int day, size_t width, Align align = LEFT) {
+        size_t start = buffer.size();
+        appendDate(buffer, day);
+        return pad(start, width, align);
+    }
+    
+    // Ends a row; output goes to the sinks once a block has built up
+    ReportWriter& endLine() {
+        buffer += '\n';
+        if (buffer.size() >= FLUSH_BYTES && !sinks.empty()) {
+            flush();
+        }
+        return *this;
+    }
+    
+    void flush() {
+        if (sinks.empty()) {
+            return;
+        }
+        for (ostream* sink : sinks) {
+            writeTo(*sink);
+            sink->flush();
+        }
+        buffer.clear();
+    }
+    
+    void writeTo(ostream& sink) const {
+        sink.write(buffer.data(), streamsize(buffer.size()));
+    }
+    
+    // Text rendered so far and not yet flushed
+    string_view rendered() const { return buffer; }
+    
+private:
+    static const size_t FLUSH_BYTES = 64 * 1024;
+    
+    ReportWriter& pad(size_t start, size_t width, Align align) {
+        size_t length = buffer.size() - start;
+        if (length < width) {
+            if (align == LEFT) {
+                buffer.append(width - length, ' ');
+            } else {
+                buffer.insert(start, width - length, ' ');
+            }
+        }
+        return *this;
+    }
+    
+    string buffer;
+    vector<ostream*> sinks;
+};
+
+// Operation statistics. Every thread records into counters of its own (a
+// single writer each, relaxed atomics, no locks), and a dump adds up the
+// counters of all threads. Latency histograms have four buckets per power of
+// two nanoseconds.
+enum StatOp {
+    STAT_LOAD, STAT_SAVE, STAT_FILE_WRITE, STAT_JOURNAL_WRITE, STAT_ENTRY_INSERT, STAT_DAILY_REPORT,
+    STAT_CUSTOMER_SEARCH, STAT_RANGE_SEARCH, STAT_BILL, STAT_RATE_CHANGE, STAT_COMPACT, STAT_PARTITION_LOAD,
+    STAT_CUSTOMER_LOOKUP, STAT_ARCHIVE_READ, STAT_ANALYTICS, STAT_OPS
+};
+enum StatCounter { STAT_BYTES_READ, STAT_BYTES_WRITTEN, STAT_ENTRIES_INSERTED, STAT_COUNTERS };
+const int LATENCY_BUCKETS = 192;
+
+struct ThreadStats {
+    atomic<uint64_t> calls[STAT_OPS];
+    atomic<uint64_t> totalNs[STAT_OPS];
+    atomic<uint64_t> maxNs[STAT_OPS];
+    atomic<uint64_t> latency[STAT_OPS][LATENCY_BUCKETS];
+    atomic<uint64_t> counters[STAT_COUNTERS];
+};
+
+void recordLatency(StatOp op, uint64_t nanoseconds);
+void countStat(StatCounter counter, uint64_t amount);
+
+// Times the enclosing scope as one call of op
+class StatTimer {
+public:
+    explicit StatTimer(StatOp op) : op(op), start(chrono::steady_clock::now()) {}
+    ~StatTimer() {
+        recordLatency(op, uint64_t(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count()));
+    }
+    
+    StatTimer(const StatTimer&) = delete;
+    StatTimer& operator=(const StatTimer&) = delete;
+    
+private:
+    StatOp op;
+    chrono::steady_clock::time_point start;
 };
+static_assert(sizeof(SnapshotHeader) == 56, "SnapshotHeader layout is part of the file format");
+static_assert(sizeof(SnapshotCustomer) == 32, "SnapshotCustomer layout is part of the file format");
+static_assert(sizeof(ArchiveHeader) == 32, "ArchiveHeader layout is part of the file format");
+static_assert(sizeof(ArchiveBlock) == 40, "ArchiveBlock layout is part of the file format");
 
 // Function prototypes
 void displayMenu();
@@ -38,23 +614,332 @@ void addMilkEntry();
 void viewDailyEntries();
 void generateBill();
 void searchEntries();
-void saveDataToFile();
+void viewDashboard();
+int createCustomer(Customer& customer);
+size_t reviseRate(Customer& customer, int fromDay, double rate);
+void recordMilkEntry(MilkEntry& entry, const Customer& customer);
+EntryTotals monthToDateTotals(int day);
+int runScript(istream& in);
+bool writeDailyEntries(ReportWriter& out, int day, EntryPage* page = nullptr);
+bool writeCustomerEntries(ReportWriter& out, const Customer& customer, EntryPage* page = nullptr);
+bool writeEntriesBetween(ReportWriter& out, int startDay, int endDay, EntryPage* page = nullptr);
+bool renderBill(ReportWriter& out, const Customer& customer, int startDay, int endDay);
+bool saveDataToFile();
+DataImage captureImage(bool changedMonthsOnly);
+bool writeDataFiles(DataImage& image);
+void applySavedImage(const DataImage& image);
+bool startBackgroundSave();
+void finishBackgroundSave(bool wait);
+void backgroundSaveTick();
 void loadDataFromFile();
+bool saveCsvFiles(const DataImage& image);
+void loadCsvFiles();
+bool saveCustomerFile(const DataImage& image);
+void loadCustomerFile();
+bool writeEntryFile(const string& path, const EntryColumns& entries, size_t first, size_t last, uint64_t seq);
+bool readEntryFile(const string& path, vector<MilkEntry>& rows, uint64_t& seq);
+bool saveRates(const DataImage& image);
+void loadRates();
+bool writeSnapshot(const string& path, const DataImage& image);
+bool loadSnapshot(const string& path);
+bool writeArchiveFile(const string& path, const EntryColumns& entries, size_t first, size_t last, uint64_t seq);
+bool readArchiveFile(const string& path, int32_t customerId, int startDay, int endDay, 
+                     vector<MilkEntry>& rows, uint64_t& seq);
+bool readFile(const string& path, string& contents);
+size_t splitCsvLine(string_view line, string_view* fields, size_t maxFields);
+bool parseInt(string_view text, int32_t& value);
+bool parseDouble(string_view text, double& value);
+bool parseFixed(string_view text, int decimals, int32_t& value);
 string getCurrentDate();
-double calculateAmount(double quantity, double rate);
+int32_t calculateAmount(int32_t quantityMl, double rate);
+double rateOn(const Customer& customer, int day);
+size_t setRate(Customer& customer, int fromDay, double rate, uint64_t seq, bool loadMonths);
+size_t repriceStaleRows(vector<MilkEntry>& rows, uint64_t fileSeq);
+Customer* findCustomer(int id);
+void rebuildCustomerIndex();
+void indexCustomerText(const Customer& customer, int sign);
+vector<const Customer*> searchCustomers(string_view query, size_t limit);
+const Customer* promptCustomer();
+int parseDate(string_view date);
+int dayFromCivil(int year, int month, int dayOfMonth);
+string formatDate(int day);
+void civilFromDay(int day, int& year, int& month, int& dayOfMonth);
+int monthOf(int day);
+int firstDayOfMonth(int month);
+int32_t toMillilitres(double liters);
+double toLiters(long long millilitres);
+double toRupees(long long paise);
+string formatFixed(long long value, int decimals);
+string formatRate(double rate);
+void appendEntryFields(string& out, const MilkEntry& entry);
+void insertMilkEntry(const MilkEntry& entry);
+void insertMilkEntries(vector<MilkEntry>& batch);
+pair<size_t, size_t> entriesBetween(int startDay, int endDay);
+EntryTotals sumEntries(size_t first, size_t last, int32_t customerId);
+void addToRollups(const MilkEntry& entry, int sign);
+void rebuildRollups();
+EntryTotals dayTotals(int day);
+EntryTotals customerMonthTotals(int customerId, int month);
+void upsertCustomer(const Customer& customer);
+void removeCustomer(int id);
+bool isDeleted(int customerId);
+void compactDeletedCustomers();
+vector<pair<int, bool>> compactableMonths();
+bool compactMonthFiles(const unordered_set<int>& deleted, const vector<pair<int, bool>>& months,
+                       vector<pair<int, bool>>& compacted);
+void dropDeletedCustomers(const unordered_set<int>& deleted, const vector<pair<int, bool>>& compacted);
+bool hasEntries();
+void loadPartitions(int startDay, int endDay);
+void trimPartitions();
+void markPartitionDirty(int day);
+void adoptResidentEntries();
+bool savePartitions(const DataImage& image);
+bool loadPartitionedStore();
+template <typename Visit>
+bool scanEntries(int startDay, int endDay, int32_t customerId, Visit visit, size_t skip = 0,
+                 EntryTotals* totals = nullptr);
+int archiveStore();
+void configureJournal();
+void openJournal();
+void journalRecord(const string& record);
+void journalWrite(const string& lines, int count);
+void journalCustomer(char type, const Customer& customer);
+void journalEntry(const MilkEntry& entry);
+void journalEntries(const vector<MilkEntry>& entries);
+string entryRecord(const MilkEntry& entry);
+int ingestFile(const string& path);
+const char* parseEntryLine(string_view line, MilkEntry& entry);
+int runServer(const string& socketPath);
+void writeBillHeader(ReportWriter& out, const Customer& customer, const string& startDate, const string& endDate);
+void writeBillRow(ReportWriter& out, const MilkEntry& entry);
+void writeBillFooter(ReportWriter& out, long long totalMl, long long totalPaise);
+string billFileName(const Customer& customer, const string& startDate, const string& endDate);
+int billAll(const string& startDate, const string& endDate, unsigned threadCount);
+GroupTotals aggregateEntries(int startDay, int endDay, unsigned threadCount);
+int runAnalytics(const string& startDate, const string& endDate, size_t topCount, unsigned threadCount);
+void clearData();
+void writeStats(ostream& out);
+void dumpStatsAtExit();
+void generateDataset(const DatasetSpec& spec);
+int runBenchmarks(size_t maxEntries, uint64_t seed);
+int replayJournal(uint64_t afterSeq);
+bool checkpoint();
+void discardJournal();
+void syncFile(FILE* file);
+bool replaceFile(const string& from, const string& to);
 
 // Global vectors to store data
 vector<Customer> customers;
-vector<MilkEntry> milkEntries;
 
-int main() {
+// Highest customer ID ever issued, kept in rates.dat so that the ID of a
+// deleted customer is never given out again
+int lastCustomerId = 0;
+
+// Kept sorted by day (ties in insertion order), so any date range is a
+// contiguous slice found by binary search.
+EntryColumns milkEntries;
+
+// Customer ID -> position in customers, kept in step with every add/delete
+unordered_map<int, size_t> customerIndex;
+
+// Search index over customer names, addresses and phone numbers, kept in step
+// with customerIndex: every word (for prefix matches) and every trigram of
+// every word (for matches despite typos), mapped to the live customers. Words
+// are interned in customerText, so each distinct word is stored once.
+vector<pair<string_view, int>> searchWords;           // (word, customer ID), sorted
+unordered_map<uint32_t, vector<int>> searchTrigrams;  // trigram -> customer IDs
+
+// Running totals updated with every entry added or removed, so day and month
+// figures are lookups rather than scans: one per day, and one per customer
+// per month (keyed by customer ID in the high half, month in the low half).
+unordered_map<int32_t, EntryTotals> dailyRollups;
+unordered_map<uint64_t, EntryTotals> customerMonthRollups;
+
+// Tombstones for customers deleted since the last compaction. Their record
+// and entries stay in place, skipped by lookups and reports, until the next
+// save leaves them out of the files and then drops them from memory.
+unordered_set<int> deletedCustomers;
+
+// Rate history of customers whose rate has been revised, sorted by fromDay
+// and starting at day 0. Stored amounts are priced from it; a revision only
+// reprices the entries in the period it covers. Customers without a history
+// pay Customer::rate on every day, which otherwise tracks the latest change.
+const char* RATES_FILE = "rates.dat";
+unordered_map<int, vector<RateChange>> rateHistory;
+
+// Append-only journal of changes made since the last checkpoint. Every record
+// carries a sequence number; milk_entries.dat remembers the last one it holds,
+// so replay after a crash never applies a change twice.
+const char* JOURNAL_FILE = "journal.log";
+FILE* journalFile = nullptr;
+uint64_t journalSeq = 0;        // sequence number of the last change applied
+int journalFsyncEvery = 1;      // group commit size; 0 leaves syncing to the OS
+int checkpointEvery = 10000;    // journal records between data file rewrites
+int journalUnsynced = 0;
+int journalSinceCheckpoint = 0;
+
+// Background saves. The store is copied between operations, the journal is
+// rotated to journal.log.1, and a worker thread writes the copy while new
+// changes go to a fresh journal. The old segment is deleted once the files
+// are in place; until then loading replays both.
+const char* OLD_JOURNAL_FILE = "journal.log.1";
+thread saveThread;
+unique_ptr<DataImage> savingImage;  // what saveThread is writing
+atomic<bool> saveFinished(false);
+atomic<bool> saveSucceeded(false);
+int saveIntervalSeconds = 300;      // DAIRY_SAVE_INTERVAL; 0 saves only on demand and by record count
+chrono::steady_clock::time_point lastSaveStarted = chrono::steady_clock::now();
+
+// Optional binary snapshot. When it exists it is the latest save and the CSV
+// files are only an export; saving CSV removes it again.
+const char* SNAPSHOT_FILE = "dairy.snap";
+bool snapshotEnabled = false;   // DAIRY_SNAPSHOT=1 saves snapshots instead of CSV
+bool ignoreSnapshot = false;    // set by import-csv
+
+// Optional month-partitioned entry store. Each month's entries live in
+// entries/YYYY-MM.dat, in the milk_entries.dat format, headed by the journal
+// sequence number that file is consistent with. Only the current month is
+// loaded at startup; other months are loaded when a report, insert or rate
+// change reaches them, and beyond the resident limit the least recently used
+// unchanged ones are dropped between operations. Changed months stay until
+// the next save, so "Exit Without Saving" still discards them.
+const char* PARTITION_DIR = "entries";
+const char* PARTITION_SEQ_FILE = "entries/seq";
+bool partitionsEnabled = false; // DAIRY_PARTITIONS=1, or the directory exists
+size_t residentMonthLimit = 6;  // DAIRY_RESIDENT_MONTHS
+map<int, Partition> partitions; // by monthOf
+uint64_t partitionClock = 0;
+bool partitionsPinned = false;  // server mode, outside the writer: no month loaded or dropped
+
+// Closed months older than this many months are saved as packed archive files
+// (see ArchiveHeader) instead of CSV. Customer reports read the blocks they
+// need straight from an archive without loading the month (see scanEntries).
+int archiveAfterMonths = 12;    // DAIRY_ARCHIVE_MONTHS; 0 = never archive
+
+// Statistics registry: one ThreadStats per live thread that has recorded
+// anything. A thread's block goes on the free list when it exits, counts and
+// all, and the next new thread adds to it, so short-lived threads (one per
+// server connection) cost no memory once they are gone. The lock is only
+// taken on a thread's first use and at its exit.
+mutex statsRegistryMutex;
+vector<unique_ptr<ThreadStats>> statsRegistry;
+vector<ThreadStats*> freeThreadStats;
+bool printStatsOnExit = false;  // --stats
+string statsFile;               // DAIRY_STATS_FILE
+
+int main(int argc, char* argv[]) {
+    // --stats anywhere on the command line prints the statistics on exit
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            printStatsOnExit = true;
+            copy(argv + i + 1, argv + argc, argv + i);
+            --argc;
+            --i;
+        }
+    }
+    
+    configureJournal();
+    if (printStatsOnExit || !statsFile.empty()) {
+        atexit(dumpStatsAtExit);
+    }
+    
+    if (argc > 1) {
+        string command = argv[1];
+        if (command == "export-csv") {
+            loadDataFromFile();
+            loadPartitions(0, numeric_limits<int>::max());
+            DataImage image = captureImage(false);
+            saveRates(image);
+            saveCsvFiles(image);
+            cout << "Exported " << customers.size() << " customers and " 
+                 << milkEntries.size() << " milk entries to CSV.\n";
+            return 0;
+        }
+        if (command == "import-csv") {
+            ignoreSnapshot = true;
+            loadDataFromFile();
+            checkpoint();
+            cout << "Imported " << customers.size() << " customers and " 
+                 << milkEntries.size() << " milk entries from CSV.\n";
+            return 0;
+        }
+        if (command == "ingest" && argc == 3) {
+            loadDataFromFile();
+            openJournal();
+            int result = ingestFile(argv[2]);
+            finishBackgroundSave(true);
+            trimPartitions();
+            return result;
+        }
+        if (command == "analytics" && argc >= 4 && argc <= 6) {
+            loadDataFromFile();
+            size_t topCount = argc >= 5 ? size_t(max(1, atoi(argv[4]))) : 10;
+            unsigned threadCount = argc == 6 ? unsigned(max(1, atoi(argv[5]))) : thread::hardware_concurrency();
+            return runAnalytics(argv[2], argv[3], topCount, max(1u, threadCount));
+        }
+        if (command == "bill-all" && (argc == 4 || argc == 5)) {
+            loadDataFromFile();
+            unsigned threadCount = argc == 5 ? unsigned(max(1, atoi(argv[4]))) : thread::hardware_concurrency();
+            return billAll(argv[2], argv[3], max(1u, threadCount));
+        }
+        if (command == "generate" && (argc == 4 || argc == 5)) {
+            DatasetSpec spec;
+            spec.customers = max(1, atoi(argv[2]));
+            spec.days = max(1, atoi(argv[3]));
+            spec.seed = argc == 5 ? strtoull(argv[4], nullptr, 10) : spec.seed;
+            generateDataset(spec);
+            checkpoint();
+            cout << "Generated " << customers.size() << " customers and " 
+                 << milkEntries.size() << " milk entries.\n";
+            return 0;
+        }
+        if (command == "archive") {
+            return archiveStore();
+        }
+        if (command == "script" && argc <= 3) {
+            loadDataFromFile();
+            openJournal();
+            if (argc == 3) {
+                ifstream script(argv[2]);
+                if (!script) {
+                    cout << "Cannot open " << argv[2] << "!\n";
+                    return 1;
+                }
+                return runScript(script);
+            }
+            return runScript(cin);
+        }
+        if (command == "serve" && argc <= 3) {
+            return runServer(argc == 3 ? argv[2] : "dairy.sock");
+        }
+        if (command == "bench" && argc <= 4) {
+            size_t maxEntries = argc >= 3 ? strtoull(argv[2], nullptr, 10) : 1000000;
+            uint64_t seed = argc == 4 ? strtoull(argv[3], nullptr, 10) : 1;
+            return runBenchmarks(max<size_t>(1000, maxEntries), seed);
+        }
+        cout << "Unknown command: " << command << "\n";
+        cout << "Usage: " << argv[0] << " [--stats] [export-csv | import-csv | ingest FILE | bill-all START END [THREADS]\n"
+             << "       | analytics START END [TOP] [THREADS]\n"
+             << "       | generate CUSTOMERS DAYS [SEED] | bench [MAX_ENTRIES] [SEED] | serve [SOCKET]\n"
+             << "       | archive | script [FILE]]\n";
+        return 1;
+    }
+    
     loadDataFromFile();
+    openJournal();
     
     int choice;
     do {
         displayMenu();
         cout << "Enter your choice: ";
-        cin >> choice;
+        if (!(cin >> choice)) {
+            if (cin.eof()) {
+                // Input closed: leave the journal for the next start
+                break;
+            }
+            cin.clear();
+            choice = 0;
+        }
         
         switch(choice) {
             case 1:
@@ -82,11 +967,25 @@ int main() {
                 searchEntries();
                 break;
             case 9:
-                saveDataToFile();
+                checkpoint();
                 cout << "Data saved successfully. Exiting...\n";
                 break;
             case 10:
-                cout << "Exiting without saving...\n";
+                discardJournal();
+                cout << "Exiting without saving (changes since the last checkpoint are discarded)...\n";
+                break;
+            case 11:
+                viewDashboard();
+                break;
+            case 12:
+                writeStats(cout);
+                break;
+            case 13:
+                if (startBackgroundSave()) {
+                    cout << "Saving in the background; you can carry on working.\n";
+                } else {
+                    cout << "Data saved.\n";
+                }
                 break;
             default:
                 cout << "Invalid choice. Please try again.\n";
@@ -96,14 +995,27 @@ int main() {
         cin.ignore(numeric_limits<streamsize>::max(), '\n');
         cout << "\nPress Enter to continue...";
         cin.get();
+        trimPartitions();
+        backgroundSaveTick();
         
     } while(choice != 9 && choice != 10);
     
+    // A save still running when input closes is let finish
+    finishBackgroundSave(true);
     return 0;
 }
 
 void displayMenu() {
-    system("cls"); // Clear screen (Windows specific)
+    // Clear the screen with an escape sequence rather than a shell, and only
+    // when it is a terminal
+#ifdef _WIN32
+    bool terminal = _isatty(_fileno(stdout));
+#else
+    bool terminal = isatty(STDOUT_FILENO);
+#endif
+    if (terminal) {
+        cout << "\033[2J\033[H";
+    }
     cout << "====================================\n";
     cout << "     MILK DAIRY MANAGEMENT SYSTEM   \n";
     cout << "====================================\n";
@@ -117,59 +1029,87 @@ void displayMenu() {
     cout << "8. Search Entries\n";
     cout << "9. Save and Exit\n";
     cout << "10. Exit Without Saving\n";
+    cout << "11. Dashboard\n";
+    cout << "12. Statistics\n";
+    cout << "13. Save Now\n";
     cout << "====================================\n";
 }
 
 void addCustomer() {
     Customer newCustomer;
+    string name, address, phone;
     
     cout << "\n--- Add New Customer ---\n";
     
-    // Generate customer ID
-    if (customers.empty()) {
-        newCustomer.id = 1;
-    } else {
-        newCustomer.id = customers.back().id + 1;
-    }
-    
-    cout << "Customer ID: " << newCustomer.id << endl;
+    cout << "Customer ID: " << lastCustomerId + 1 << endl;
     
     cin.ignore();
     cout << "Enter Name: ";
-    getline(cin, newCustomer.name);
+    getline(cin, name);
+    newCustomer.name = name;
     
     cout << "Enter Address: ";
-    getline(cin, newCustomer.address);
+    getline(cin, address);
+    newCustomer.address = address;
     
     cout << "Enter Phone: ";
-    getline(cin, newCustomer.phone);
+    getline(cin, phone);
+    newCustomer.phone = phone;
     
     cout << "Enter Rate per liter: ";
     cin >> newCustomer.rate;
     
-    customers.push_back(newCustomer);
+    createCustomer(newCustomer);
     
     cout << "\nCustomer added successfully!\n";
 }
 
+// Changes shared by the menu and the script mode; each is journaled
+
+// Gives the customer the next ID and adds it; returns the ID
+int createCustomer(Customer& customer) {
+    customer.id = lastCustomerId + 1;
+    upsertCustomer(customer);
+    journalCustomer('C', customer);
+    return customer.id;
+}
+
+// Sets a customer's rate from fromDay on; returns the entries repriced
+size_t reviseRate(Customer& customer, int fromDay, double rate) {
+    size_t repriced = setRate(customer, fromDay, rate, journalSeq + 1, true);
+    stringstream ss;
+    ss << "R," << customer.id << "," << formatDate(fromDay) << "," << formatRate(rate);
+    journalRecord(ss.str());
+    return repriced;
+}
+
+// Prices an entry at the customer's rate for its day and adds it
+void recordMilkEntry(MilkEntry& entry, const Customer& customer) {
+    entry.amountPaise = calculateAmount(entry.totalMl(), rateOn(customer, entry.day));
+    insertMilkEntry(entry);
+    journalEntry(entry);
+}
+
 void viewCustomers() {
     if (customers.empty()) {
         cout << "\nNo customers found!\n";
         return;
     }
     
-    cout << "\n--- Customer List ---\n";
-    cout << "----------------------------------------------------------------------------\n";
-    cout << left << setw(8) << "ID" << setw(25) << "Name" << setw(30) << "Address" 
-         << setw(15) << "Phone" << setw(10) << "Rate/L" << endl;
-    cout << "----------------------------------------------------------------------------\n";
+    ReportWriter out(cout);
+    out.text("\n--- Customer List ---\n");
+    out.text("----------------------------------------------------------------------------\n");
+    out.cell("ID", 8).cell("Name", 25).cell("Address", 30).cell("Phone", 15).cell("Rate/L", 10).endLine();
+    out.text("----------------------------------------------------------------------------\n");
     
     for (const auto& customer : customers) {
-        cout << left << setw(8) << customer.id << setw(25) << customer.name 
-             << setw(30) << customer.address << setw(15) << customer.phone 
-             << setw(10) << fixed << setprecision(2) << customer.rate << endl;
+        if (isDeleted(customer.id)) {
+            continue;
+        }
+        out.cell(customer.id, 8).cell(customer.name, 25).cell(customer.address, 30)
+           .cell(customer.phone, 15).rate(customer.rate, 10).endLine();
     }
-    cout << "----------------------------------------------------------------------------\n";
+    out.text("----------------------------------------------------------------------------\n");
 }
 
 void updateCustomer() {
@@ -180,40 +1120,61 @@ void updateCustomer() {
     cout << "Enter Customer ID to update: ";
     cin >> id;
     
-    for (auto& customer : customers) {
-        if (customer.id == id) {
-            found = true;
-            
-            cout << "\nCurrent Details:\n";
-            cout << "Name: " << customer.name << endl;
-            cout << "Address: " << customer.address << endl;
-            cout << "Phone: " << customer.phone << endl;
-            cout << "Rate: " << customer.rate << endl;
-            
+    Customer* customer = findCustomer(id);
+    if (customer) {
+        found = true;
+        
+        cout << "\nCurrent Details:\n";
+        cout << "Name: " << customer->name << endl;
+        cout << "Address: " << customer->address << endl;
+        cout << "Phone: " << customer->phone << endl;
+        cout << "Rate: " << customer->rate << endl;
+        
+        Customer updated = *customer;
+        cin.ignore();
+        cout << "\nEnter New Name (press Enter to keep current): ";
+        string newName;
+        getline(cin, newName);
+        if (!newName.empty()) updated.name = newName;
+        
+        cout << "Enter New Address (press Enter to keep current): ";
+        string newAddress;
+        getline(cin, newAddress);
+        if (!newAddress.empty()) updated.address = newAddress;
+        
+        cout << "Enter New Phone (press Enter to keep current): ";
+        string newPhone;
+        getline(cin, newPhone);
+        if (!newPhone.empty()) updated.phone = newPhone;
+        
+        cout << "Enter New Rate (enter 0 to keep current): ";
+        double newRate;
+        cin >> newRate;
+        
+        upsertCustomer(updated);
+        journalCustomer('U', updated);
+        
+        if (newRate != 0) {
+            cout << "Rate effective from (DD-MM-YYYY) or press Enter for today (" << getCurrentDate() << "): ";
             cin.ignore();
-            cout << "\nEnter New Name (press Enter to keep current): ";
-            string newName;
-            getline(cin, newName);
-            if (!newName.empty()) customer.name = newName;
-            
-            cout << "Enter New Address (press Enter to keep current): ";
-            string newAddress;
-            getline(cin, newAddress);
-            if (!newAddress.empty()) customer.address = newAddress;
-            
-            cout << "Enter New Phone (press Enter to keep current): ";
-            string newPhone;
-            getline(cin, newPhone);
-            if (!newPhone.empty()) customer.phone = newPhone;
-            
-            cout << "Enter New Rate (enter 0 to keep current): ";
-            double newRate;
-            cin >> newRate;
-            if (newRate != 0) customer.rate = newRate;
+            string fromDate;
+            getline(cin, fromDate);
+            if (fromDate.empty()) {
+                fromDate = getCurrentDate();
+            }
             
-            cout << "\nCustomer information updated successfully!\n";
-            break;
+            int fromDay = parseDate(fromDate);
+            if (fromDay < 0) {
+                cout << "Invalid date " << fromDate << "! Rate not changed.\n";
+            } else if ((customer = findCustomer(updated.id))) {
+                // Looked up again: the customer may have moved since it was journaled
+                size_t repriced = reviseRate(*customer, fromDay, newRate);
+                cout << "Rate set to " << newRate << " from " << fromDate << "; " 
+                     << repriced << " entr" << (repriced == 1 ? "y" : "ies") << " repriced.\n";
+            }
         }
+        
+        cout << "\nCustomer information updated successfully!\n";
     }
     
     if (!found) {
@@ -229,21 +1190,12 @@ void deleteCustomer() {
     cout << "Enter Customer ID to delete: ";
     cin >> id;
     
-    for (auto it = customers.begin(); it != customers.end(); ++it) {
-        if (it->id == id) {
-            found = true;
-            
-            // Also remove all milk entries for this customer
-            milkEntries.erase(
-                remove_if(milkEntries.begin(), milkEntries.end(), 
-                    [id](const MilkEntry& entry) { return entry.customerId == id; }),
-                milkEntries.end()
-            );
-            
-            customers.erase(it);
-            cout << "\nCustomer and all related milk entries deleted successfully!\n";
-            break;
-        }
+    if (findCustomer(id)) {
+        found = true;
+        
+        removeCustomer(id);
+        journalRecord("D," + to_string(id));
+        cout << "\nCustomer and all related milk entries deleted successfully!\n";
     }
     
     if (!found) {
@@ -258,60 +1210,137 @@ void addMilkEntry() {
     }
     
     MilkEntry newEntry;
+    string date;
     
     cout << "\n--- Add Milk Entry ---\n";
     
-    // Display customers for reference
-    viewCustomers();
-    
-    cout << "\nEnter Customer ID: ";
-    cin >> newEntry.customerId;
-    
-    // Verify customer exists
-    bool customerExists = false;
-    double rate = 0.0;
-    for (const auto& customer : customers) {
-        if (customer.id == newEntry.customerId) {
-            customerExists = true;
-            rate = customer.rate;
-            break;
-        }
-    }
-    
-    if (!customerExists) {
-        cout << "Customer with ID " << newEntry.customerId << " not found!\n";
+    const Customer* customer = promptCustomer();
+    if (!customer) {
         return;
     }
+    newEntry.customerId = customer->id;
+    cout << "Customer: " << customer->name << "\n";
     
     cout << "Enter Date (DD-MM-YYYY) or press Enter for today (" << getCurrentDate() << "): ";
-    cin.ignore();
     string dateInput;
     getline(cin, dateInput);
     
     if (dateInput.empty()) {
-        newEntry.date = getCurrentDate();
+        date = getCurrentDate();
     } else {
-        newEntry.date = dateInput;
+        date = dateInput;
+    }
+    
+    newEntry.day = parseDate(date);
+    if (newEntry.day < 0) {
+        cout << "Invalid date " << date << "! Use DD-MM-YYYY.\n";
+        return;
     }
     
+    double morningQty, eveningQty;
     cout << "Enter Morning Quantity (liters): ";
-    cin >> newEntry.morningQty;
+    cin >> morningQty;
     
     cout << "Enter Evening Quantity (liters): ";
-    cin >> newEntry.eveningQty;
+    cin >> eveningQty;
     
-    newEntry.totalQty = newEntry.morningQty + newEntry.eveningQty;
-    newEntry.amount = calculateAmount(newEntry.totalQty, rate);
+    if (!(morningQty >= 0 && eveningQty >= 0)) {
+        cout << "Quantities cannot be negative!\n";
+        return;
+    }
     
-    milkEntries.push_back(newEntry);
+    newEntry.morningMl = toMillilitres(morningQty);
+    newEntry.eveningMl = toMillilitres(eveningQty);
+    recordMilkEntry(newEntry, *customer);
     
     cout << "\nMilk entry added successfully!\n";
-    cout << "Total Quantity: " << newEntry.totalQty << " liters\n";
-    cout << "Total Amount: Rs. " << fixed << setprecision(2) << newEntry.amount << endl;
+    cout << "Total Quantity: " << toLiters(newEntry.totalMl()) << " liters\n";
+    cout << "Total Amount: Rs. " << fixed << setprecision(2) << toRupees(newEntry.amountPaise) << endl;
+}
+
+// Between pages of a long menu report: asks whether to go on, and moves the
+// page along if so
+static bool nextPage(ReportWriter& out, EntryPage& page) {
+    if (!page.more) {
+        return false;
+    }
+    out.flush();
+    cout << "\nPress Enter for the next " << page.limit << " entries, or Q to stop: ";
+    string answer;
+    if (!getline(cin, answer) || (!answer.empty() && toupper((unsigned char)answer[0]) == 'Q')) {
+        return false;
+    }
+    page.offset += page.limit;
+    return true;
+}
+
+// Whether a report showed only part of its rows
+static bool showsPart(const EntryPage& page) {
+    return page.offset > 0 || page.more;
+}
+
+// Closes a report that showed one page of its rows
+static void writePageNote(ReportWriter& out, const EntryPage& page, long long shown) {
+    if (!showsPart(page)) {
+        return;
+    }
+    out.text("Entries ").cell((long long)page.offset + 1, 0).text(" to ").cell((long long)page.offset + shown, 0);
+    out.text(page.more ? " shown, more follow\n" : " shown\n");
+}
+
+// Scans the rows of a customer or range report that fall in the page, passing
+// each to row and adding them up in shown. The first page also totals the
+// whole report; a later one starts at the point the page before left.
+template <typename Row>
+static void scanPage(int startDay, int endDay, int32_t customerId, EntryPage& page, EntryTotals& shown, Row row) {
+    int month = page.resumeMonth;
+    size_t inMonth = page.resumeSkip;
+    size_t skip = page.offset;
+    if (month >= 0) {
+        startDay = max(startDay, firstDayOfMonth(month));
+        skip = inMonth;
+    }
+    // Rows passed over by offset alone are not counted into a month
+    bool tracked = month >= 0 || page.offset == 0;
+    page.more = false;
+    page.resumeMonth = -1;
+    scanEntries(startDay, endDay, customerId, [&](const MilkEntry& entry) {
+        if (monthOf(entry.day) != month) {
+            month = monthOf(entry.day);
+            inMonth = 0;
+        }
+        if (size_t(shown.count) == page.limit) {
+            page.more = true;
+            if (tracked) {
+                page.resumeMonth = month;
+                page.resumeSkip = inMonth;
+            }
+            return false;
+        }
+        row(entry);
+        shown.add(entry);
+        ++inMonth;
+        return true;
+    }, skip, page.totaled ? nullptr : &page.total);
+    page.totaled = true;
+}
+
+// Closes a report: the total of the page shown, if that is not all of it,
+// then of the whole report
+static void writeReportTotals(ReportWriter& out, int width, const EntryPage& page, const EntryTotals& shown) {
+    out.text("----------------------------------------------------------------------------\n");
+    if (showsPart(page)) {
+        out.cell("Page total: ", width, RIGHT).liters(shown.totalMl(), 10, RIGHT)
+           .rupees(shown.amountPaise, 12, RIGHT).endLine();
+    }
+    out.cell("Total: ", width, RIGHT).liters(page.total.totalMl(), 10, RIGHT)
+       .rupees(page.total.amountPaise, 12, RIGHT).endLine();
+    out.text("----------------------------------------------------------------------------\n");
+    writePageNote(out, page, shown.count);
 }
 
 void viewDailyEntries() {
-    if (milkEntries.empty()) {
+    if (!hasEntries()) {
         cout << "\nNo milk entries found!\n";
         return;
     }
@@ -326,133 +1355,244 @@ void viewDailyEntries() {
         date = getCurrentDate();
     }
     
-    vector<MilkEntry> entriesForDate;
-    for (const auto& entry : milkEntries) {
-        if (entry.date == date) {
-            entriesForDate.push_back(entry);
-        }
+    int day = parseDate(date);
+    if (day < 0) {
+        cout << "Invalid date " << date << "! Use DD-MM-YYYY.\n";
+        return;
     }
     
-    if (entriesForDate.empty()) {
+    ReportWriter out(cout);
+    EntryPage page;
+    page.limit = MENU_PAGE_ROWS;
+    if (!writeDailyEntries(out, day, &page)) {
         cout << "\nNo entries found for date " << date << "!\n";
-        return;
+    }
+    while (nextPage(out, page)) {
+        writeDailyEntries(out, day, &page);
+    }
+}
+
+// Report bodies shared by the menu, the server and the benchmark. Each returns
+// false, having written nothing, when there are no entries to show. Given a
+// page, they show only that window of their rows; the rows are read straight
+// from the store, never copied into a result first.
+bool writeDailyEntries(ReportWriter& out, int day, EntryPage* page) {
+    StatTimer timer(STAT_DAILY_REPORT);
+    EntryPage whole;
+    EntryPage& window = page ? *page : whole;
+    window.more = false;
+    loadPartitions(day, day);
+    window.total = dayTotals(day);
+    window.totaled = true;
+    if (window.total.count == 0) {
+        return false;
     }
     
-    cout << "\n--- Milk Entries for " << date << " ---\n";
-    cout << "----------------------------------------------------------------------------\n";
-    cout << left << setw(8) << "Cust ID" << setw(15) << "Name" << setw(10) << "Morning" 
-         << setw(10) << "Evening" << setw(10) << "Total" << setw(12) << "Amount" << endl;
-    cout << "----------------------------------------------------------------------------\n";
-    
-    double totalQty = 0;
-    double totalAmount = 0;
-    
-    for (const auto& entry : entriesForDate) {
+    EntryTotals shown;
+    scanEntries(day, day, ALL_CUSTOMERS, [&](const MilkEntry& entry) {
+        if (size_t(shown.count) == window.limit) {
+            window.more = true;
+            return false;
+        }
+        if (shown.count == 0) {
+            out.text("\n--- Milk Entries for ").date(day, 0).text(" ---\n");
+            out.text("----------------------------------------------------------------------------\n");
+            out.cell("Cust ID", 8).cell("Name", 15).cell("Morning", 10).cell("Evening", 10)
+               .cell("Total", 10).cell("Amount", 12).endLine();
+            out.text("----------------------------------------------------------------------------\n");
+        }
+        shown.add(entry);
+        
         // Find customer name
-        string customerName = "Unknown";
-        for (const auto& customer : customers) {
-            if (customer.id == entry.customerId) {
-                customerName = customer.name;
-                break;
-            }
+        const Customer* customer = findCustomer(entry.customerId);
+        string_view customerName = customer ? string_view(customer->name) : "Unknown";
+        
+        out.cell(entry.customerId, 8).cell(customerName, 15).liters(entry.morningMl, 10)
+           .liters(entry.eveningMl, 10).liters(entry.totalMl(), 10).rupees(entry.amountPaise, 12).endLine();
+        return true;
+    }, window.offset);
+    if (shown.count == 0) {
+        return false;
+    }
+    writeReportTotals(out, 43, window, shown);
+    return true;
+}
+
+// The customer and range reports stream their rows: the heading goes out with
+// the first row
+bool writeCustomerEntries(ReportWriter& out, const Customer& customer, EntryPage* page) {
+    StatTimer timer(STAT_CUSTOMER_SEARCH);
+    EntryPage whole;
+    EntryPage& window = page ? *page : whole;
+    EntryTotals shown;
+    scanPage(0, LAST_DAY, customer.id, window, shown, [&](const MilkEntry& entry) {
+        if (shown.count == 0) {
+            out.text("\n--- All Entries for ").text(customer.name).text(" ---\n");
+            out.text("----------------------------------------------------------------------------\n");
+            out.cell("Date", 12).cell("Morning", 10).cell("Evening", 10).cell("Total", 10).cell("Amount", 12).endLine();
+            out.text("----------------------------------------------------------------------------\n");
+        }
+        out.date(entry.day, 12).liters(entry.morningMl, 10).liters(entry.eveningMl, 10)
+           .liters(entry.totalMl(), 10).rupees(entry.amountPaise, 12).endLine();
+    });
+    if (shown.count == 0) {
+        return false;
+    }
+    writeReportTotals(out, 42, window, shown);
+    return true;
+}
+
+bool writeEntriesBetween(ReportWriter& out, int startDay, int endDay, EntryPage* page) {
+    StatTimer timer(STAT_RANGE_SEARCH);
+    EntryPage whole;
+    EntryPage& window = page ? *page : whole;
+    EntryTotals shown;
+    scanPage(startDay, endDay, ALL_CUSTOMERS, window, shown, [&](const MilkEntry& entry) {
+        if (shown.count == 0) {
+            out.text("\n--- Entries between ").date(startDay, 0).text(" and ").date(endDay, 0).text(" ---\n");
+            out.text("----------------------------------------------------------------------------\n");
+            out.cell("Cust ID", 8).cell("Name", 15).cell("Date", 12).cell("Morning", 10)
+               .cell("Evening", 10).cell("Total", 10).cell("Amount", 12).endLine();
+            out.text("----------------------------------------------------------------------------\n");
         }
         
-        cout << left << setw(8) << entry.customerId << setw(15) << customerName 
-             << setw(10) << fixed << setprecision(2) << entry.morningQty 
-             << setw(10) << entry.eveningQty << setw(10) << entry.totalQty 
-             << setw(12) << entry.amount << endl;
-             
-        totalQty += entry.totalQty;
-        totalAmount += entry.amount;
+        // Find customer name
+        const Customer* customer = findCustomer(entry.customerId);
+        string_view customerName = customer ? string_view(customer->name) : "Unknown";
+        
+        out.cell(entry.customerId, 8).cell(customerName, 15).date(entry.day, 12).liters(entry.morningMl, 10)
+           .liters(entry.eveningMl, 10).liters(entry.totalMl(), 10).rupees(entry.amountPaise, 12).endLine();
+    });
+    if (shown.count == 0) {
+        return false;
     }
-    
-    cout << "----------------------------------------------------------------------------\n";
-    cout << right << setw(43) << "Total: " << setw(10) << totalQty << setw(12) << totalAmount << endl;
-    cout << "----------------------------------------------------------------------------\n";
+    writeReportTotals(out, 55, window, shown);
+    return true;
 }
 
-void generateBill() {
-    if (customers.empty() || milkEntries.empty()) {
-        cout << "\nNo data available to generate bill!\n";
+bool renderBill(ReportWriter& out, const Customer& customer, int startDay, int endDay) {
+    StatTimer timer(STAT_BILL);
+    EntryTotals totals;
+    bool started = false;
+    scanEntries(startDay, endDay, customer.id, [&](const MilkEntry& entry) {
+        if (!started) {
+            writeBillHeader(out, customer, formatDate(startDay), formatDate(endDay));
+            started = true;
+        }
+        writeBillRow(out, entry);
+        return true;
+    }, 0, &totals);
+    if (totals.count == 0) {
+        return false;
+    }
+    writeBillFooter(out, totals.totalMl(), totals.amountPaise);
+    return true;
+}
+
+// Totals for a day and its month so far, read from the rollups
+void viewDashboard() {
+    string date;
+    cout << "\n--- Dashboard ---\n";
+    cout << "Enter Date (DD-MM-YYYY) or press Enter for today (" << getCurrentDate() << "): ";
+    cin.ignore();
+    getline(cin, date);
+    
+    if (date.empty()) {
+        date = getCurrentDate();
+    }
+    
+    int day = parseDate(date);
+    if (day < 0) {
+        cout << "Invalid date " << date << "! Use DD-MM-YYYY.\n";
         return;
     }
     
-    int customerId;
-    string startDate, endDate;
+    int year, month, dayOfMonth;
+    civilFromDay(day, year, month, dayOfMonth);
+    loadPartitions(day - dayOfMonth + 1, day);
+    EntryTotals today = dayTotals(day);
+    EntryTotals monthToDate = monthToDateTotals(day);
     
-    cout << "\n--- Generate Bill ---\n";
-    viewCustomers();
+    ReportWriter out(cout);
+    out.text("----------------------------------------------------------------------------\n");
+    out.cell("", 16).cell("Entries", 10).cell("Morning", 12).cell("Evening", 12).cell("Total", 12).cell("Amount", 12).endLine();
+    out.text("----------------------------------------------------------------------------\n");
+    out.cell(date, 16).cell(today.count, 10).liters(today.morningMl, 12).liters(today.eveningMl, 12)
+       .liters(today.totalMl(), 12).rupees(today.amountPaise, 12).endLine();
+    out.cell("Month to date", 16).cell(monthToDate.count, 10).liters(monthToDate.morningMl, 12)
+       .liters(monthToDate.eveningMl, 12).liters(monthToDate.totalMl(), 12).rupees(monthToDate.amountPaise, 12).endLine();
+    out.text("----------------------------------------------------------------------------\n");
+    out.flush();
     
-    cout << "\nEnter Customer ID: ";
+    int customerId;
+    cout << "\nEnter Customer ID for their month (0 to skip): ";
     cin >> customerId;
-    
-    // Verify customer exists
-    bool customerExists = false;
-    string customerName;
-    double rate = 0.0;
-    for (const auto& customer : customers) {
-        if (customer.id == customerId) {
-            customerExists = true;
-            customerName = customer.name;
-            rate = customer.rate;
-            break;
-        }
+    if (customerId == 0) {
+        return;
     }
     
-    if (!customerExists) {
+    const Customer* customer = findCustomer(customerId);
+    if (!customer) {
         cout << "Customer with ID " << customerId << " not found!\n";
         return;
     }
     
-    cin.ignore();
+    EntryTotals totals = customerMonthTotals(customerId, monthOf(day));
+    out.text("\n").text(customer->name).text(", ").text(date.substr(3)).endLine();
+    out.cell("Entries: ", 18).cell(totals.count, 0).endLine();
+    out.cell("Morning (L): ", 18).liters(totals.morningMl, 0).endLine();
+    out.cell("Evening (L): ", 18).liters(totals.eveningMl, 0).endLine();
+    out.cell("Total (L): ", 18).liters(totals.totalMl(), 0).endLine();
+    out.cell("Amount (Rs.): ", 18).rupees(totals.amountPaise, 0).endLine();
+}
+
+// Totals from the first of day's month to day; the month must be loaded
+EntryTotals monthToDateTotals(int day) {
+    EntryTotals totals;
+    for (int d = firstDayOfMonth(monthOf(day)); d <= day; ++d) {
+        totals.add(dayTotals(d));
+    }
+    return totals;
+}
+
+void generateBill() {
+    if (customers.empty() || !hasEntries()) {
+        cout << "\nNo data available to generate bill!\n";
+        return;
+    }
+    
+    string startDate, endDate;
+    
+    cout << "\n--- Generate Bill ---\n";
+    const Customer* customer = promptCustomer();
+    if (!customer) {
+        return;
+    }
+    string customerName = customer->name.str();
+    cout << "Customer: " << customerName << "\n";
+    
     cout << "Enter Start Date (DD-MM-YYYY): ";
     getline(cin, startDate);
     
     cout << "Enter End Date (DD-MM-YYYY): ";
     getline(cin, endDate);
     
-    // Collect all entries for this customer in date range
-    vector<MilkEntry> customerEntries;
-    double totalQty = 0;
-    double totalAmount = 0;
-    
-    for (const auto& entry : milkEntries) {
-        if (entry.customerId == customerId && entry.date >= startDate && entry.date <= endDate) {
-            customerEntries.push_back(entry);
-            totalQty += entry.totalQty;
-            totalAmount += entry.amount;
-        }
+    int startDay = parseDate(startDate);
+    int endDay = parseDate(endDate);
+    if (startDay < 0 || endDay < 0) {
+        cout << "Invalid date! Use DD-MM-YYYY.\n";
+        return;
     }
     
-    if (customerEntries.empty()) {
+    // Render the bill once; the same text goes to the screen and, if asked, the file
+    ReportWriter bill;
+    if (!renderBill(bill, *customer, startDay, endDay)) {
         cout << "\nNo entries found for customer " << customerName << " between " 
              << startDate << " and " << endDate << "!\n";
         return;
     }
-    
-    // Display bill
-    cout << "\n====================================\n";
-    cout << "          MILK DAIRY BILL          \n";
-    cout << "====================================\n";
-    cout << "Customer ID: " << customerId << "\n";
-    cout << "Customer Name: " << customerName << "\n";
-    cout << "Bill Period: " << startDate << " to " << endDate << "\n";
-    cout << "Rate per liter: Rs. " << fixed << setprecision(2) << rate << "\n";
-    cout << "====================================\n";
-    cout << left << setw(12) << "Date" << setw(10) << "Morning" 
-         << setw(10) << "Evening" << setw(10) << "Total" << setw(12) << "Amount" << endl;
-    cout << "------------------------------------\n";
-    
-    for (const auto& entry : customerEntries) {
-        cout << left << setw(12) << entry.date << setw(10) << fixed << setprecision(2) << entry.morningQty 
-             << setw(10) << entry.eveningQty << setw(10) << entry.totalQty 
-             << setw(12) << entry.amount << endl;
-    }
-    
-    cout << "====================================\n";
-    cout << right << setw(32) << "Total Quantity: " << setw(10) << totalQty << " liters\n";
-    cout << right << setw(32) << "Total Amount: Rs. " << setw(10) << totalAmount << "\n";
-    cout << "====================================\n";
+    cout << "\n";
+    bill.writeTo(cout);
     
     // Option to save bill to file
     cout << "\nDo you want to save this bill to a file? (y/n): ";
@@ -460,33 +1600,13 @@ void generateBill() {
     cin >> choice;
     
     if (tolower(choice) == 'y') {
-        string filename = "Bill_" + customerName + "_" + startDate + "_to_" + endDate + ".txt";
+        string filename = billFileName(*customer, startDate, endDate);
         ofstream outFile(filename);
         
         if (outFile) {
-            outFile << "====================================\n";
-            outFile << "          MILK DAIRY BILL          \n";
-            outFile << "====================================\n";
-            outFile << "Customer ID: " << customerId << "\n";
-            outFile << "Customer Name: " << customerName << "\n";
-            outFile << "Bill Period: " << startDate << " to " << endDate << "\n";
-            outFile << "Rate per liter: Rs. " << fixed << setprecision(2) << rate << "\n";
-            outFile << "====================================\n";
-            outFile << left << setw(12) << "Date" << setw(10) << "Morning" 
-                    << setw(10) << "Evening" << setw(10) << "Total" << setw(12) << "Amount" << endl;
-            outFile << "------------------------------------\n";
-            
-            for (const auto& entry : customerEntries) {
-                outFile << left << setw(12) << entry.date << setw(10) << fixed << setprecision(2) << entry.morningQty 
-                        << setw(10) << entry.eveningQty << setw(10) << entry.totalQty 
-                        << setw(12) << entry.amount << endl;
-            }
-            
-            outFile << "====================================\n";
-            outFile << right << setw(32) << "Total Quantity: " << setw(10) << totalQty << " liters\n";
-            outFile << right << setw(32) << "Total Amount: Rs. " << setw(10) << totalAmount << "\n";
-            outFile << "====================================\n";
-            
+            StatTimer timer(STAT_FILE_WRITE);
+            bill.writeTo(outFile);
+            countStat(STAT_BYTES_WRITTEN, uint64_t(outFile.tellp()));
             outFile.close();
             cout << "Bill saved to file: " << filename << "\n";
         } else {
@@ -495,74 +1615,75 @@ void generateBill() {
     }
 }
 
+void writeBillHeader(ReportWriter& out, const Customer& customer, const string& startDate, const string& endDate) {
+    out.text("====================================\n");
+    out.text("          MILK DAIRY BILL          \n");
+    out.text("====================================\n");
+    out.text("Customer ID: ").cell(customer.id, 0).endLine();
+    out.text("Customer Name: ").text(customer.name).endLine();
+    out.text("Bill Period: ").text(startDate).text(" to ").text(endDate).endLine();
+    int startDay = parseDate(startDate);
+    int endDay = parseDate(endDate);
+    out.text("Rate per liter: Rs. ").rate(rateOn(customer, startDay), 0).endLine();
+    auto history = rateHistory.find(customer.id);
+    if (history != rateHistory.end()) {
+        for (const auto& change : history->second) {
+            if (change.fromDay > startDay && change.fromDay <= endDay) {
+                out.text("Rate from ").date(change.fromDay, 0).text(": Rs. ").rate(change.rate, 0).endLine();
+            }
+        }
+    }
+    out.text("====================================\n");
+    out.cell("Date", 12).cell("Morning", 10).cell("Evening", 10).cell("Total", 10).cell("Amount", 12).endLine();
+    out.text("------------------------------------\n");
+}
+
+void writeBillRow(ReportWriter& out, const MilkEntry& entry) {
+    out.date(entry.day, 12).liters(entry.morningMl, 10).liters(entry.eveningMl, 10)
+       .liters(entry.totalMl(), 10).rupees(entry.amountPaise, 12).endLine();
+}
+
+void writeBillFooter(ReportWriter& out, long long totalMl, long long totalPaise) {
+    out.text("====================================\n");
+    out.cell("Total Quantity: ", 32, RIGHT).liters(totalMl, 10, RIGHT).text(" liters").endLine();
+    out.cell("Total Amount: Rs. ", 32, RIGHT).rupees(totalPaise, 10, RIGHT).endLine();
+    out.text("====================================\n");
+}
+
+// The ID keeps apart the bills of customers with the same name
+string billFileName(const Customer& customer, const string& startDate, const string& endDate) {
+    return "Bill_" + to_string(customer.id) + "_" + customer.name.str() + "_" + startDate + "_to_" + endDate + ".txt";
+}
+
 void searchEntries() {
-    if (milkEntries.empty()) {
+    if (!hasEntries()) {
         cout << "\nNo milk entries found!\n";
         return;
     }
     
     int choice;
     cout << "\n--- Search Entries ---\n";
-    cout << "1. Search by Customer ID\n";
+    cout << "1. Search by Customer (ID, name, phone or address)\n";
     cout << "2. Search by Date Range\n";
     cout << "Enter your choice: ";
     cin >> choice;
     
     if (choice == 1) {
-        int customerId;
-        cout << "Enter Customer ID: ";
-        cin >> customerId;
-        
-        // Verify customer exists
-        bool customerExists = false;
-        string customerName;
-        for (const auto& customer : customers) {
-            if (customer.id == customerId) {
-                customerExists = true;
-                customerName = customer.name;
-                break;
-            }
-        }
-        
-        if (!customerExists) {
-            cout << "Customer with ID " << customerId << " not found!\n";
+        const Customer* customer = promptCustomer();
+        if (!customer) {
             return;
         }
         
-        vector<MilkEntry> customerEntries;
-        for (const auto& entry : milkEntries) {
-            if (entry.customerId == customerId) {
-                customerEntries.push_back(entry);
-            }
-        }
-        
-        if (customerEntries.empty()) {
-            cout << "\nNo entries found for customer " << customerName << "!\n";
-            return;
+        ReportWriter out(cout);
+        EntryPage page;
+        page.limit = MENU_PAGE_ROWS;
+        if (!writeCustomerEntries(out, *customer, &page)) {
+            cout << "\nNo entries found for customer " << customer->name << "!\n";
         }
-        
-        cout << "\n--- All Entries for " << customerName << " ---\n";
-        cout << "----------------------------------------------------------------------------\n";
-        cout << left << setw(12) << "Date" << setw(10) << "Morning" 
-             << setw(10) << "Evening" << setw(10) << "Total" << setw(12) << "Amount" << endl;
-        cout << "----------------------------------------------------------------------------\n";
-        
-        double totalQty = 0;
-        double totalAmount = 0;
-        
-        for (const auto& entry : customerEntries) {
-            cout << left << setw(12) << entry.date << setw(10) << fixed << setprecision(2) << entry.morningQty 
-                 << setw(10) << entry.eveningQty << setw(10) << entry.totalQty 
-                 << setw(12) << entry.amount << endl;
-                 
-            totalQty += entry.totalQty;
-            totalAmount += entry.amount;
+        while (nextPage(out, page)) {
+            writeCustomerEntries(out, *customer, &page);
         }
         
-        cout << "----------------------------------------------------------------------------\n";
-        cout << right << setw(42) << "Total: " << setw(10) << totalQty << setw(12) << totalAmount << endl;
-        cout << "----------------------------------------------------------------------------\n";
-        
     } else if (choice == 2) {
         string startDate, endDate;
         cin.ignore();
@@ -572,131 +1693,478 @@ void searchEntries() {
         cout << "Enter End Date (DD-MM-YYYY): ";
         getline(cin, endDate);
         
-        vector<MilkEntry> dateRangeEntries;
-        for (const auto& entry : milkEntries) {
-            if (entry.date >= startDate && entry.date <= endDate) {
-                dateRangeEntries.push_back(entry);
-            }
+        int startDay = parseDate(startDate);
+        int endDay = parseDate(endDate);
+        if (startDay < 0 || endDay < 0) {
+            cout << "Invalid date! Use DD-MM-YYYY.\n";
+            return;
         }
         
-        if (dateRangeEntries.empty()) {
+        ReportWriter out(cout);
+        EntryPage page;
+        page.limit = MENU_PAGE_ROWS;
+        if (!writeEntriesBetween(out, startDay, endDay, &page)) {
             cout << "\nNo entries found between " << startDate << " and " << endDate << "!\n";
-            return;
         }
-        
-        cout << "\n--- Entries between " << startDate << " and " << endDate << " ---\n";
-        cout << "----------------------------------------------------------------------------\n";
-        cout << left << setw(8) << "Cust ID" << setw(15) << "Name" << setw(12) << "Date" 
-             << setw(10) << "Morning" << setw(10) << "Evening" << setw(10) << "Total" << setw(12) << "Amount" << endl;
-        cout << "----------------------------------------------------------------------------\n";
-        
-        double totalQty = 0;
-        double totalAmount = 0;
-        
-        for (const auto& entry : dateRangeEntries) {
-            // Find customer name
-            string customerName = "Unknown";
-            for (const auto& customer : customers) {
-                if (customer.id == entry.customerId) {
-                    customerName = customer.name;
-                    break;
-                }
-            }
-            
-            cout << left << setw(8) << entry.customerId << setw(15) << customerName 
-                 << setw(12) << entry.date << setw(10) << fixed << setprecision(2) << entry.morningQty 
-                 << setw(10) << entry.eveningQty << setw(10) << entry.totalQty 
-                 << setw(12) << entry.amount << endl;
-                 
-            totalQty += entry.totalQty;
-            totalAmount += entry.amount;
+        while (nextPage(out, page)) {
+            writeEntriesBetween(out, startDay, endDay, &page);
         }
         
-        cout << "----------------------------------------------------------------------------\n";
-        cout << right << setw(55) << "Total: " << setw(10) << totalQty << setw(12) << totalAmount << endl;
-        cout << "----------------------------------------------------------------------------\n";
-        
     } else {
         cout << "Invalid choice!\n";
     }
 }
 
-void saveDataToFile() {
-    // Save customers
-    ofstream customerFile("customers.dat");
-    if (customerFile) {
-        for (const auto& customer : customers) {
-            customerFile << customer.id << "," << customer.name << "," 
-                         << customer.address << "," << customer.phone << "," 
-                         << customer.rate << "\n";
+// Writes the data files on this thread. Returns false if any failed.
+bool saveDataToFile() {
+    DataImage image = captureImage(partitionsEnabled);
+    if (!writeDataFiles(image)) {
+        return false;
+    }
+    applySavedImage(image);
+    return true;
+}
+
+// Copies the store for a save; in partition mode only the changed months.
+// Deleted customers are left out; their entries are filtered out by the save.
+DataImage captureImage(bool changedMonthsOnly) {
+    DataImage image;
+    image.journalSeq = journalSeq;
+    image.lastCustomerId = lastCustomerId;
+    image.deleted = deletedCustomers;
+    image.customers.reserve(customers.size());
+    for (const auto& customer : customers) {
+        if (!isDeleted(customer.id)) {
+            image.customers.push_back(customer);
         }
-        customerFile.close();
     }
-    
-    // Save milk entries
-    ofstream milkFile("milk_entries.dat");
-    if (milkFile) {
-        for (const auto& entry : milkEntries) {
-            milkFile << entry.customerId << "," << entry.date << "," 
-                     << entry.morningQty << "," << entry.eveningQty << "," 
-                     << entry.totalQty << "," << entry.amount << "\n";
+    image.rateHistory = rateHistory;
+    for (int id : deletedCustomers) {
+        image.rateHistory.erase(id);
+    }
+    if (!changedMonthsOnly) {
+        image.entries = milkEntries;
+        return image;
+    }
+    if (archiveAfterMonths > 0) {
+        image.archiveBefore = monthOf(parseDate(getCurrentDate())) - archiveAfterMonths;
+    }
+    if (!image.deleted.empty()) {
+        image.compactMonths = compactableMonths();
+    }
+    for (const auto& month : partitions) {
+        image.knownMonths.push_back(month.first);
+        if (month.second.dirty) {
+            image.months.emplace_back(month.first, month.second.version);
+            auto range = entriesBetween(firstDayOfMonth(month.first), firstDayOfMonth(month.first + 1) - 1);
+            image.entries.append(milkEntries, range.first, range.second);
+        }
+    }
+    return image;
+}
+
+// Writes an image to the data files. Reads nothing but the image and the
+// month files it compacts, so it can run on any thread.
+bool writeDataFiles(DataImage& image) {
+    StatTimer timer(STAT_SAVE);
+    if (!image.deleted.empty()) {
+        image.entries.filter([&](const MilkEntry& entry) { return image.deleted.count(entry.customerId) == 0; });
+    }
+    // Rates go first: replaying a rate change that is already saved is harmless
+    bool ok = saveRates(image);
+    if (partitionsEnabled) {
+        // Deleted customers leave the month files before customers.dat, so
+        // their entries are never saved without them
+        ok = compactMonthFiles(image.deleted, image.compactMonths, image.compacted) &&
+             saveCustomerFile(image) && savePartitions(image) && ok;
+    } else if (snapshotEnabled) {
+        return writeSnapshot(SNAPSHOT_FILE, image) && ok;
+    } else {
+        ok = saveCsvFiles(image) && ok;
+    }
+    if (ok) {
+        // The CSV files or partitions are now the latest save
+        remove(SNAPSHOT_FILE);
+    }
+    return ok;
+}
+
+// Marks the months an image held as saved, unless they changed since, and
+// drops the customers it compacted away from memory
+void applySavedImage(const DataImage& image) {
+    size_t first = 0;
+    for (const auto& saved : image.months) {
+        const vector<int32_t>& days = image.entries.day;
+        size_t last = lower_bound(days.begin() + first, days.end(), firstDayOfMonth(saved.first + 1)) - days.begin();
+        auto partition = partitions.find(saved.first);
+        if (partition != partitions.end() && partition->second.version == saved.second) {
+            partition->second.dirty = false;
+            partition->second.onDisk = last > first;
+            partition->second.archived = saved.first < image.archiveBefore;
+            partition->second.seq = image.journalSeq;
         }
-        milkFile.close();
+        first = last;
+    }
+    if (!image.deleted.empty()) {
+        dropDeletedCustomers(image.deleted, image.compacted);
     }
 }
 
 void loadDataFromFile() {
-    // Load customers
-    ifstream customerFile("customers.dat");
-    if (customerFile) {
-        string line;
-        while (getline(customerFile, line)) {
-            stringstream ss(line);
-            string token;
-            vector<string> tokens;
+    StatTimer timer(STAT_LOAD);
+    bool partitioned = !ignoreSnapshot && partitionsEnabled && loadPartitionedStore();
+    if (!partitioned && (ignoreSnapshot || !loadSnapshot(SNAPSHOT_FILE))) {
+        loadCsvFiles();
+    }
+    if (partitionsEnabled && !partitioned) {
+        // Split the store into months at the next save
+        adoptResidentEntries();
+    }
+    loadRates();
+    rebuildRollups();
+    
+    // Re-apply changes made after the data files were last written. Partition
+    // files each carry their own sequence number, which replay checks entry
+    // records against, so the whole journal is read. Rate changes reprice
+    // only the resident months; the rest are repriced as they are read.
+    int replayed = replayJournal(partitioned ? 0 : journalSeq);
+    if (replayed > 0) {
+        cout << "Recovered " << replayed << " unsaved change(s) from " << JOURNAL_FILE << "\n";
+    }
+    // Replayed deletions stay tombstones until the next save
+    trimPartitions();
+}
+
+// Each file is written to a temporary name and renamed into place, so a crash
+// mid-save leaves the previous copy intact. milk_entries.dat carries the
+// journal sequence number it is consistent with; customer records are replayed
+// whatever their number. While deletions are pending the entries go first, so
+// a deleted customer's rows are never left behind once the record is gone.
+bool saveCsvFiles(const DataImage& image) {
+    auto saveEntries = [&image] {
+        return writeEntryFile("milk_entries.dat", image.entries, 0, image.entries.size(), image.journalSeq);
+    };
+    if (!image.deleted.empty()) {
+        return saveEntries() && saveCustomerFile(image);
+    }
+    return saveCustomerFile(image) && saveEntries();
+}
+
+bool saveCustomerFile(const DataImage& image) {
+    ofstream customerFile("customers.dat.tmp");
+    if (!customerFile) {
+        cout << "Error saving customers.dat!\n";
+        return false;
+    }
+    StatTimer timer(STAT_FILE_WRITE);
+    for (const auto& customer : image.customers) {
+        customerFile << customer.id << "," << customer.name << "," 
+                     << customer.address << "," << customer.phone << "," 
+                     << formatRate(customer.rate) << "\n";
+    }
+    countStat(STAT_BYTES_WRITTEN, uint64_t(customerFile.tellp()));
+    customerFile.close();
+    return bool(customerFile) && replaceFile("customers.dat.tmp", "customers.dat");
+}
+
+// Writes entries[first, last) in the milk_entries.dat format, headed by the
+// journal sequence number the rows are consistent with
+bool writeEntryFile(const string& path, const EntryColumns& entries, size_t first, size_t last, uint64_t seq) {
+    ofstream milkFile(path + ".tmp");
+    if (!milkFile) {
+        cout << "Error saving " << path << "!\n";
+        return false;
+    }
+    StatTimer timer(STAT_FILE_WRITE);
+    // Rows are formatted into a buffer that is written out in large blocks
+    string buffer = "#seq," + to_string(seq) + "\n";
+    for (size_t i = first; i < last; ++i) {
+        const MilkEntry entry = entries[i];
+        appendEntryFields(buffer, entry);
+        buffer += ',';
+        appendFixed(buffer, entry.totalMl(), 3);
+        buffer += ',';
+        appendFixed(buffer, entry.amountPaise, 2);
+        buffer += '\n';
+        if (buffer.size() >= (1 << 20)) {
+            milkFile.write(buffer.data(), buffer.size());
+            countStat(STAT_BYTES_WRITTEN, buffer.size());
+            buffer.clear();
+        }
+    }
+    milkFile.write(buffer.data(), buffer.size());
+    countStat(STAT_BYTES_WRITTEN, buffer.size());
+    milkFile.close();
+    return bool(milkFile) && replaceFile(path + ".tmp", path);
+}
+
+// A slice of milk_entries.dat parsed by one loader thread
+struct CsvChunk {
+    string_view text;
+    vector<MilkEntry> rows;
+    vector<pair<size_t, string>> errors; // line number within the chunk, reason
+    size_t lines = 0;
+    uint64_t seq = 0;
+};
+
+// Parses "customerId,date,morning,evening,total,amount" lines in place
+static void parseEntryChunk(CsvChunk& chunk) {
+    const char* cursor = chunk.text.data();
+    const char* end = cursor + chunk.text.size();
+    string_view fields[7];
+    
+    while (cursor < end) {
+        const char* newline = (const char*)memchr(cursor, '\n', end - cursor);
+        const char* lineEnd = newline ? newline : end;
+        string_view line(cursor, lineEnd - cursor);
+        cursor = newline ? newline + 1 : end;
+        ++chunk.lines;
+        
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        if (line.empty()) {
+            continue;
+        }
+        if (line[0] == '#') {
+            if (line.substr(0, 5) == "#seq,") {
+                from_chars(line.data() + 5, line.data() + line.size(), chunk.seq);
+            }
+            continue;
+        }
+        
+        const char* reason = nullptr;
+        MilkEntry entry;
+        // The total column is derived, so it is not read back
+        if (splitCsvLine(line, fields, 7) != 6) {
+            reason = "expected 6 fields";
+        } else if (!parseInt(fields[0], entry.customerId)) {
+            reason = "bad customer ID";
+        } else if ((entry.day = parseDate(fields[1])) < 0) {
+            reason = "bad date";
+        } else if (!parseFixed(fields[2], 3, entry.morningMl) || !parseFixed(fields[3], 3, entry.eveningMl)) {
+            reason = "bad quantity";
+        } else if (!parseFixed(fields[5], 2, entry.amountPaise)) {
+            reason = "bad amount";
+        }
+        
+        if (reason) {
+            chunk.errors.emplace_back(chunk.lines, reason);
+        } else {
+            chunk.rows.push_back(entry);
+        }
+    }
+}
+
+static void reportMalformedLines(const string& path, const vector<pair<size_t, string>>& errors) {
+    const size_t shown = 10;
+    for (size_t i = 0; i < errors.size() && i < shown; ++i) {
+        cout << "Warning: " << path << " line " << errors[i].first 
+             << " skipped (" << errors[i].second << ")\n";
+    }
+    if (errors.size() > shown) {
+        cout << "Warning: " << errors.size() - shown << " more malformed line(s) in " << path << " skipped\n";
+    }
+}
+
+// Reads both CSV files without per-line allocation: fields are split in place
+// and numbers converted with from_chars. Large entry files are cut at line
+// boundaries and parsed on all cores, then merged back in file order.
+void loadCsvFiles() {
+    loadCustomerFile();
+    
+    vector<MilkEntry> rows;
+    uint64_t seq = 0;
+    if (readEntryFile("milk_entries.dat", rows, seq)) {
+        journalSeq = max(journalSeq, seq);
+        milkEntries.assign(rows);
+    }
+}
+
+void loadCustomerFile() {
+    string contents;
+    if (readFile("customers.dat", contents)) {
+        vector<pair<size_t, string>> errors;
+        string_view fields[6];
+        size_t lineNumber = 0;
+        size_t pos = 0;
+        while (pos < contents.size()) {
+            size_t newline = contents.find('\n', pos);
+            if (newline == string::npos) {
+                newline = contents.size();
+            }
+            string_view line(contents.data() + pos, newline - pos);
+            pos = newline + 1;
+            ++lineNumber;
             
-            while (getline(ss, token, ',')) {
-                tokens.push_back(token);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            if (line.empty()) {
+                continue;
             }
             
-            if (tokens.size() == 5) {
-                Customer customer;
-                customer.id = stoi(tokens[0]);
-                customer.name = tokens[1];
-                customer.address = tokens[2];
-                customer.phone = tokens[3];
-                customer.rate = stod(tokens[4]);
+            Customer customer;
+            if (splitCsvLine(line, fields, 6) != 5) {
+                errors.emplace_back(lineNumber, "expected 5 fields");
+            } else if (!parseInt(fields[0], customer.id)) {
+                errors.emplace_back(lineNumber, "bad customer ID");
+            } else if (!parseDouble(fields[4], customer.rate)) {
+                errors.emplace_back(lineNumber, "bad rate");
+            } else {
+                customer.name = fields[1];
+                customer.address = fields[2];
+                customer.phone = fields[3];
                 customers.push_back(customer);
             }
         }
-        customerFile.close();
+        reportMalformedLines("customers.dat", errors);
+    }
+    rebuildCustomerIndex();
+}
+
+// Reads an entry file into rows, in day order, and the sequence number in its
+// header. Returns false if the file cannot be read.
+bool readEntryFile(const string& path, vector<MilkEntry>& rows, uint64_t& seq) {
+    string contents;
+    if (!readFile(path, contents)) {
+        return false;
     }
+    const size_t minChunkBytes = 1 << 20;
+    size_t threads = max(1u, thread::hardware_concurrency());
+    size_t chunkCount = max<size_t>(1, min(threads, contents.size() / minChunkBytes));
     
-    // Load milk entries
-    ifstream milkFile("milk_entries.dat");
-    if (milkFile) {
-        string line;
-        while (getline(milkFile, line)) {
-            stringstream ss(line);
-            string token;
-            vector<string> tokens;
-            
-            while (getline(ss, token, ',')) {
-                tokens.push_back(token);
-            }
-            
-            if (tokens.size() == 6) {
-                MilkEntry entry;
-                entry.customerId = stoi(tokens[0]);
-                entry.date = tokens[1];
-                entry.morningQty = stod(tokens[2]);
-                entry.eveningQty = stod(tokens[3]);
-                entry.totalQty = stod(tokens[4]);
-                entry.amount = stod(tokens[5]);
-                milkEntries.push_back(entry);
+    // Cut the file after a newline near each 1/chunkCount mark
+    vector<CsvChunk> chunks(chunkCount);
+    size_t begin = 0;
+    for (size_t i = 0; i < chunkCount; ++i) {
+        size_t end = contents.size();
+        if (i + 1 < chunkCount) {
+            end = contents.find('\n', max(begin, contents.size() * (i + 1) / chunkCount));
+            end = end == string::npos ? contents.size() : end + 1;
+        }
+        chunks[i].text = string_view(contents.data() + begin, end - begin);
+        begin = end;
+    }
+    
+    vector<thread> workers;
+    for (size_t i = 1; i < chunkCount; ++i) {
+        workers.emplace_back(parseEntryChunk, ref(chunks[i]));
+    }
+    parseEntryChunk(chunks[0]);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    
+    size_t total = 0;
+    for (const auto& chunk : chunks) {
+        total += chunk.rows.size();
+    }
+    vector<pair<size_t, string>> errors;
+    rows.clear();
+    rows.reserve(total);
+    size_t lineOffset = 0;
+    for (auto& chunk : chunks) {
+        rows.insert(rows.end(), chunk.rows.begin(), chunk.rows.end());
+        for (auto& error : chunk.errors) {
+            errors.emplace_back(lineOffset + error.first, move(error.second));
+        }
+        lineOffset += chunk.lines;
+        seq = max(seq, chunk.seq);
+    }
+    reportMalformedLines(path, errors);
+    
+    // Files written by older versions are in entry order, not date order
+    auto byDay = [](const MilkEntry& a, const MilkEntry& b) { return a.day < b.day; };
+    if (!is_sorted(rows.begin(), rows.end(), byDay)) {
+        stable_sort(rows.begin(), rows.end(), byDay);
+    }
+    return true;
+}
+
+// rates.dat holds one "customerId,DD-MM-YYYY,rate,seq" line per rate change,
+// headed by the highest customer ID ever issued
+bool saveRates(const DataImage& image) {
+    ofstream ratesFile(string(RATES_FILE) + ".tmp");
+    if (!ratesFile) {
+        cout << "Error saving " << RATES_FILE << "!\n";
+        return false;
+    }
+    StatTimer timer(STAT_FILE_WRITE);
+    ratesFile << "#lastid," << image.lastCustomerId << "\n";
+    for (const auto& customer : image.customers) {
+        auto history = image.rateHistory.find(customer.id);
+        if (history == image.rateHistory.end()) {
+            continue;
+        }
+        for (const auto& change : history->second) {
+            ratesFile << customer.id << "," << formatDate(change.fromDay) << "," << formatRate(change.rate) << "," 
+                      << change.seq << "\n";
+        }
+    }
+    countStat(STAT_BYTES_WRITTEN, uint64_t(ratesFile.tellp()));
+    ratesFile.close();
+    return bool(ratesFile) && replaceFile(string(RATES_FILE) + ".tmp", RATES_FILE);
+}
+
+void loadRates() {
+    rateHistory.clear();
+    string contents;
+    if (!readFile(RATES_FILE, contents)) {
+        return;
+    }
+    
+    vector<pair<size_t, string>> errors;
+    string_view fields[5];
+    size_t lineNumber = 0;
+    size_t pos = 0;
+    while (pos < contents.size()) {
+        size_t newline = contents.find('\n', pos);
+        if (newline == string::npos) {
+            newline = contents.size();
+        }
+        string_view line(contents.data() + pos, newline - pos);
+        pos = newline + 1;
+        ++lineNumber;
+        
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        if (line.empty()) {
+            continue;
+        }
+        
+        int32_t customerId;
+        RateChange change;
+        if (line.front() == '#') {
+            if (splitCsvLine(line, fields, 5) == 2 && fields[0] == "#lastid" && parseInt(fields[1], customerId)) {
+                lastCustomerId = max(lastCustomerId, customerId);
             }
+            continue;
+        }
+        // Files written before changes were numbered have no seq field
+        size_t count = splitCsvLine(line, fields, 5);
+        change.seq = 0;
+        if (count != 3 && count != 4) {
+            errors.emplace_back(lineNumber, "expected 4 fields");
+        } else if (!parseInt(fields[0], customerId) || !findCustomer(customerId)) {
+            errors.emplace_back(lineNumber, "unknown customer");
+        } else if ((change.fromDay = parseDate(fields[1])) < 0) {
+            errors.emplace_back(lineNumber, "bad date");
+        } else if (!parseDouble(fields[2], change.rate)) {
+            errors.emplace_back(lineNumber, "bad rate");
+        } else if (count == 4 && from_chars(fields[3].data(), fields[3].data() + fields[3].size(), 
+                                            change.seq).ptr != fields[3].data() + fields[3].size()) {
+            errors.emplace_back(lineNumber, "bad sequence number");
+        } else {
+            rateHistory[customerId].push_back(change);
         }
-        milkFile.close();
+    }
+    reportMalformedLines(RATES_FILE, errors);
+    
+    auto byDay = [](const RateChange& a, const RateChange& b) { return a.fromDay < b.fromDay; };
+    for (auto& history : rateHistory) {
+        stable_sort(history.second.begin(), history.second.end(), byDay);
     }
 }
 
@@ -712,6 +2180,3536 @@ string getCurrentDate() {
     return ss.str();
 }
 
-double calculateAmount(double quantity, double rate) {
-    return quantity * rate;
-}
\ No newline at end of file
+// Prices a quantity at a per-liter rate, rounded to the nearest paisa
+int32_t calculateAmount(int32_t quantityMl, double rate) {
+    return int32_t(llround(quantityMl * rate / 10.0));
+}
+
+// Rate the customer pays for milk delivered on the given day
+double rateOn(const Customer& customer, int day) {
+    auto history = rateHistory.find(customer.id);
+    if (history == rateHistory.end()) {
+        return customer.rate;
+    }
+    const vector<RateChange>& changes = history->second;
+    auto next = upper_bound(changes.begin(), changes.end(), day,
+                            [](int d, const RateChange& change) { return d < change.fromDay; });
+    return next == changes.begin() ? changes.front().rate : prev(next)->rate;
+}
+
+// Charges rate from fromDay until the customer's next rate change and
+// reprices the entries in that period only. Setting the same change twice
+// is harmless, which journal replay relies on. seq is the journal number of
+// the change. Unless loadMonths is set, months that are not in memory are
+// left as they are and repriced when read (see repriceStaleRows), so replay
+// does not load the history. Returns the entries repriced.
+size_t setRate(Customer& customer, int fromDay, double rate, uint64_t seq, bool loadMonths) {
+    StatTimer timer(STAT_RATE_CHANGE);
+    vector<RateChange>& changes = rateHistory[customer.id];
+    if (changes.empty()) {
+        changes.push_back(RateChange{0, customer.rate, 0});
+    }
+    auto pos = lower_bound(changes.begin(), changes.end(), fromDay,
+                           [](const RateChange& change, int d) { return change.fromDay < d; });
+    if (pos != changes.end() && pos->fromDay == fromDay) {
+        pos->rate = rate;
+        pos->seq = seq;
+    } else {
+        pos = changes.insert(pos, RateChange{fromDay, rate, seq});
+    }
+    int untilDay = next(pos) == changes.end() ? numeric_limits<int>::max() : next(pos)->fromDay - 1;
+    customer.rate = changes.back().rate;
+    
+    // Only the months the customer's rollups show entries in are loaded and
+    // scanned; a month not yet counted in the rollups has to be looked at
+    int firstMonth = numeric_limits<int>::max();
+    int lastMonth = numeric_limits<int>::min();
+    if (!milkEntries.empty()) {
+        firstMonth = monthOf(milkEntries.day.front());
+        lastMonth = monthOf(milkEntries.day.back());
+    }
+    if (!partitions.empty()) {
+        firstMonth = min(firstMonth, partitions.begin()->first);
+        lastMonth = max(lastMonth, partitions.rbegin()->first);
+    }
+    firstMonth = max(firstMonth, monthOf(max(0, fromDay)));
+    lastMonth = min(lastMonth, monthOf(min(untilDay, LAST_DAY)));
+    
+    size_t repriced = 0;
+    for (int month = firstMonth; month <= lastMonth; ++month) {
+        auto partition = partitions.find(month);
+        if (!loadMonths && partition != partitions.end() && !partition->second.rolledUp) {
+            continue;
+        }
+        if (partition == partitions.end() || partition->second.rolledUp) {
+            auto rollup = customerMonthRollups.find(uint64_t(uint32_t(customer.id)) << 32 | uint32_t(month));
+            if (rollup == customerMonthRollups.end() || rollup->second.count == 0) {
+                continue;
+            }
+        }
+        int startDay = max(fromDay, firstDayOfMonth(month));
+        int endDay = min(untilDay, firstDayOfMonth(month + 1) - 1);
+        loadPartitions(startDay, endDay);
+        auto range = entriesBetween(startDay, endDay);
+        for (size_t i = range.first; i < range.second; ++i) {
+            if (milkEntries.customerId[i] != customer.id) {
+                continue;
+            }
+            MilkEntry entry = milkEntries[i];
+            int32_t amount = calculateAmount(entry.totalMl(), rate);
+            if (amount != entry.amountPaise) {
+                addToRollups(entry, -1);
+                entry.amountPaise = milkEntries.amountPaise[i] = amount;
+                addToRollups(entry, 1);
+                markPartitionDirty(entry.day);
+            }
+            ++repriced;
+        }
+    }
+    return repriced;
+}
+
+// Reprices the rows read from a month file whose sequence number is fileSeq
+// for the rate changes made after it was written; setRate leaves such months
+// to this when replaying. Returns how many rows changed.
+size_t repriceStaleRows(vector<MilkEntry>& rows, uint64_t fileSeq) {
+    unordered_map<int, int> staleFrom; // customer ID -> first day of a newer change
+    for (const auto& history : rateHistory) {
+        for (const auto& change : history.second) {
+            if (change.seq > fileSeq) {
+                staleFrom[history.first] = change.fromDay;
+                break;
+            }
+        }
+    }
+    if (staleFrom.empty()) {
+        return 0;
+    }
+    
+    size_t changed = 0;
+    for (auto& entry : rows) {
+        auto stale = staleFrom.find(entry.customerId);
+        const Customer* customer = nullptr;
+        if (stale == staleFrom.end() || entry.day < stale->second || !(customer = findCustomer(entry.customerId))) {
+            continue;
+        }
+        int32_t amount = calculateAmount(entry.totalMl(), rateOn(*customer, entry.day));
+        if (amount != entry.amountPaise) {
+            entry.amountPaise = amount;
+            ++changed;
+        }
+    }
+    return changed;
+}
+
+Customer* findCustomer(int id) {
+    auto it = customerIndex.find(id);
+    if (it == customerIndex.end() || isDeleted(id)) {
+        return nullptr;
+    }
+    return &customers[it->second];
+}
+
+// Lowercase runs of letters and digits. A phone number is one word of its
+// digits, however it is punctuated.
+static vector<string> wordsOf(string_view text, bool phone = false) {
+    vector<string> words;
+    string word;
+    for (char c : text) {
+        if (isalnum((unsigned char)c)) {
+            word += char(tolower((unsigned char)c));
+        } else if (!phone && !word.empty()) {
+            words.push_back(move(word));
+            word.clear();
+        }
+    }
+    if (!word.empty()) {
+        words.push_back(move(word));
+    }
+    return words;
+}
+
+static vector<string> customerWords(const Customer& customer) {
+    vector<string> words = wordsOf(customer.name);
+    for (auto& word : wordsOf(customer.address)) {
+        words.push_back(move(word));
+    }
+    for (auto& word : wordsOf(customer.phone, true)) {
+        words.push_back(move(word));
+    }
+    sort(words.begin(), words.end());
+    words.erase(unique(words.begin(), words.end()), words.end());
+    return words;
+}
+
+// Distinct trigrams of the words, each padded as "  word " so that short
+// words and word starts count too. Words with digits are left out: numbers
+// are only matched by prefix.
+static vector<uint32_t> trigramsOf(const vector<string>& words) {
+    vector<uint32_t> trigrams;
+    for (const auto& word : words) {
+        if (any_of(word.begin(), word.end(), [](char c) { return isdigit((unsigned char)c); })) {
+            continue;
+        }
+        string padded = "  " + word + " ";
+        for (size_t i = 0; i + 3 <= padded.size(); ++i) {
+            trigrams.push_back(uint32_t((unsigned char)padded[i]) << 16 | 
+                               uint32_t((unsigned char)padded[i + 1]) << 8 | (unsigned char)padded[i + 2]);
+        }
+    }
+    sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(unique(trigrams.begin(), trigrams.end()), trigrams.end());
+    return trigrams;
+}
+
+void rebuildCustomerIndex() {
+    customerIndex.clear();
+    customerIndex.reserve(customers.size());
+    for (size_t i = 0; i < customers.size(); ++i) {
+        customerIndex[customers[i].id] = i;
+        lastCustomerId = max(lastCustomerId, customers[i].id);
+    }
+    
+    searchWords.clear();
+    searchTrigrams.clear();
+    for (const auto& customer : customers) {
+        if (isDeleted(customer.id)) {
+            continue;
+        }
+        vector<string> words = customerWords(customer);
+        for (uint32_t trigram : trigramsOf(words)) {
+            searchTrigrams[trigram].push_back(customer.id);
+        }
+        for (const auto& word : words) {
+            searchWords.emplace_back(PooledText(word), customer.id);
+        }
+    }
+    sort(searchWords.begin(), searchWords.end());
+}
+
+// Adds (sign 1) or removes (sign -1) a customer's words and trigrams
+void indexCustomerText(const Customer& customer, int sign) {
+    vector<string> words = customerWords(customer);
+    for (uint32_t trigram : trigramsOf(words)) {
+        vector<int>& ids = searchTrigrams[trigram];
+        if (sign > 0) {
+            ids.push_back(customer.id);
+            continue;
+        }
+        ids.erase(remove(ids.begin(), ids.end(), customer.id), ids.end());
+        if (ids.empty()) {
+            searchTrigrams.erase(trigram);
+        }
+    }
+    for (const auto& word : words) {
+        pair<string_view, int> key(PooledText(word), customer.id);
+        auto pos = lower_bound(searchWords.begin(), searchWords.end(), key);
+        if (sign > 0 && (pos == searchWords.end() || *pos != key)) {
+            searchWords.insert(pos, key);
+        } else if (sign < 0 && pos != searchWords.end() && *pos == key) {
+            searchWords.erase(pos);
+        }
+    }
+}
+
+// Customers matching a free-text query, best first. Customers with a word
+// starting with each query word are the answer, whole words ranking higher.
+// When there are none, customers sharing at least half of the query's
+// trigrams match instead, ranked by how many they share, so small typos
+// still find the customer.
+vector<const Customer*> searchCustomers(string_view query, size_t limit) {
+    StatTimer timer(STAT_CUSTOMER_LOOKUP);
+    vector<string> terms = wordsOf(query);
+    unordered_map<int, int> scores;
+    unordered_map<int, size_t> termsMatched;
+    bool allTermsMatched = false;
+    
+    for (const auto& term : terms) {
+        unordered_map<int, int> best;
+        auto pos = lower_bound(searchWords.begin(), searchWords.end(), make_pair(string_view(term), numeric_limits<int>::min()));
+        for (; pos != searchWords.end() && pos->first.compare(0, term.size(), term) == 0; ++pos) {
+            int& score = best[pos->second];
+            score = max(score, pos->first.size() == term.size() ? 120 : 100);
+        }
+        for (const auto& match : best) {
+            scores[match.first] += match.second;
+            allTermsMatched |= ++termsMatched[match.first] == terms.size();
+        }
+    }
+    
+    if (!allTermsMatched) {
+        vector<uint32_t> trigrams = trigramsOf(terms);
+        unordered_map<int, int> shared;
+        for (uint32_t trigram : trigrams) {
+            auto pos = searchTrigrams.find(trigram);
+            if (pos != searchTrigrams.end()) {
+                for (int id : pos->second) {
+                    shared[id]++;
+                }
+            }
+        }
+        for (const auto& match : shared) {
+            if (match.second * 2 >= int(trigrams.size())) {
+                scores[match.first] += match.second * 10;
+            }
+        }
+    }
+    
+    vector<pair<int, const Customer*>> ranked;
+    ranked.reserve(scores.size());
+    for (const auto& match : scores) {
+        if (allTermsMatched && termsMatched[match.first] != terms.size()) {
+            continue;
+        }
+        if (const Customer* customer = findCustomer(match.first)) {
+            ranked.emplace_back(match.second, customer);
+        }
+    }
+    auto better = [](const pair<int, const Customer*>& a, const pair<int, const Customer*>& b) {
+        return a.first != b.first ? a.first > b.first : a.second->id < b.second->id;
+    };
+    size_t count = min(limit, ranked.size());
+    partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(), better);
+    
+    vector<const Customer*> results;
+    for (size_t i = 0; i < count; ++i) {
+        results.push_back(ranked[i].second);
+    }
+    return results;
+}
+
+// Asks for a customer by ID, or searches names, phones and addresses and
+// lets the operator pick from the matches. Reads whole lines.
+const Customer* promptCustomer() {
+    string query;
+    cout << "\nEnter Customer ID, or a name, phone or address to search: ";
+    getline(cin >> ws, query);
+    
+    int32_t id;
+    if (parseInt(query, id) && findCustomer(id)) {
+        return findCustomer(id);
+    }
+    vector<const Customer*> matches = searchCustomers(query, 10);
+    if (matches.empty()) {
+        cout << "No customer matches \"" << query << "\"!\n";
+        return nullptr;
+    }
+    
+    ReportWriter out(cout);
+    out.text("----------------------------------------------------------------------------\n");
+    for (const Customer* customer : matches) {
+        out.cell(customer->id, 8).cell(customer->name, 25).cell(customer->address, 30).cell(customer->phone, 15).endLine();
+    }
+    out.text("----------------------------------------------------------------------------\n");
+    out.flush();
+    if (matches.size() == 1) {
+        return matches.front();
+    }
+    
+    cout << "Enter Customer ID: ";
+    getline(cin, query);
+    const Customer* customer = parseInt(query, id) ? findCustomer(id) : nullptr;
+    if (!customer) {
+        cout << "Customer with ID " << query << " not found!\n";
+    }
+    return customer;
+}
+
+// Converts "DD-MM-YYYY" to a day number (days since 01-01-1970).
+// Returns -1 if the text is not a valid calendar date.
+int parseDate(string_view date) {
+    if (date.size() != 10 || date[2] != '-' || date[5] != '-') {
+        return -1;
+    }
+    for (size_t i : {0, 1, 3, 4, 6, 7, 8, 9}) {
+        if (date[i] < '0' || date[i] > '9') {
+            return -1;
+        }
+    }
+    
+    int d = (date[0] - '0') * 10 + (date[1] - '0');
+    int m = (date[3] - '0') * 10 + (date[4] - '0');
+    int y = (date[6] - '0') * 1000 + (date[7] - '0') * 100 + (date[8] - '0') * 10 + (date[9] - '0');
+    
+    static const int daysInMonth[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    bool leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+    if (y < 1970 || m < 1 || m > 12 || d < 1 || d > daysInMonth[m - 1] + (m == 2 && leap)) {
+        return -1;
+    }
+    return dayFromCivil(y, m, d);
+}
+
+// Days from civil date (proleptic Gregorian), shifted so 01-01-1970 is day 0
+int dayFromCivil(int year, int month, int dayOfMonth) {
+    year -= month <= 2;
+    int era = year / 400;
+    int yoe = year - era * 400;
+    int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + dayOfMonth - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+void insertMilkEntry(const MilkEntry& entry) {
+    StatTimer timer(STAT_ENTRY_INSERT);
+    countStat(STAT_ENTRIES_INSERTED, 1);
+    loadPartitions(entry.day, entry.day);
+    // Entries nearly always arrive for the latest date, making this an append
+    const vector<int32_t>& days = milkEntries.day;
+    auto pos = upper_bound(days.begin(), days.end(), entry.day);
+    milkEntries.insert(pos - days.begin(), entry);
+    addToRollups(entry, 1);
+    markPartitionDirty(entry.day);
+}
+
+// Adds many entries at once. A batch dated on or after the newest stored day
+// is appended; otherwise the store and the batch are merged in one pass.
+void insertMilkEntries(vector<MilkEntry>& batch) {
+    if (batch.empty()) {
+        return;
+    }
+    StatTimer timer(STAT_ENTRY_INSERT);
+    countStat(STAT_ENTRIES_INSERTED, batch.size());
+    auto byDay = [](const MilkEntry& a, const MilkEntry& b) { return a.day < b.day; };
+    if (!is_sorted(batch.begin(), batch.end(), byDay)) {
+        stable_sort(batch.begin(), batch.end(), byDay);
+    }
+    loadPartitions(batch.front().day, batch.back().day);
+    for (const auto& entry : batch) {
+        addToRollups(entry, 1);
+        markPartitionDirty(entry.day);
+    }
+    
+    if (milkEntries.empty() || batch.front().day >= milkEntries.day.back()) {
+        milkEntries.reserve(milkEntries.size() + batch.size());
+        for (const auto& entry : batch) {
+            milkEntries.insert(milkEntries.size(), entry);
+        }
+        return;
+    }
+    
+    EntryColumns merged;
+    merged.reserve(milkEntries.size() + batch.size());
+    size_t i = 0, j = 0;
+    while (i < milkEntries.size() || j < batch.size()) {
+        // Stored entries go first on equal days, as if the batch were inserted one by one
+        if (j == batch.size() || (i < milkEntries.size() && milkEntries.day[i] <= batch[j].day)) {
+            merged.insert(merged.size(), milkEntries[i++]);
+        } else {
+            merged.insert(merged.size(), batch[j++]);
+        }
+    }
+    swap(milkEntries, merged);
+}
+
+// Returns the [first, last) slice of milkEntries dated startDay..endDay inclusive
+pair<size_t, size_t> entriesBetween(int startDay, int endDay) {
+    if (startDay > endDay) {
+        return {0, 0};
+    }
+    const vector<int32_t>& days = milkEntries.day;
+    auto first = lower_bound(days.begin(), days.end(), startDay);
+    auto last = upper_bound(first, days.end(), endDay);
+    return {size_t(first - days.begin()), size_t(last - days.begin())};
+}
+
+// Aggregation kernels: sum quantities and amounts over milkEntries[first, last)
+// for one customer, or for every customer when customerId is ALL_CUSTOMERS.
+// The vector versions widen each 32-bit lane to 64 bits before adding, so they
+// return exactly what the scalar loop does.
+EntryTotals sumEntriesScalar(size_t first, size_t last, int32_t customerId) {
+    EntryTotals totals;
+    const int32_t* ids = milkEntries.customerId.data();
+    const int32_t* morning = milkEntries.morningMl.data();
+    const int32_t* evening = milkEntries.eveningMl.data();
+    const int32_t* amount = milkEntries.amountPaise.data();
+    
+    for (size_t i = first; i < last; ++i) {
+        if (customerId == ALL_CUSTOMERS || ids[i] == customerId) {
+            totals.morningMl += morning[i];
+            totals.eveningMl += evening[i];
+            totals.amountPaise += amount[i];
+            totals.count++;
+        }
+    }
+    return totals;
+}
+
+// Sums every customer's rows except those of the customers in excluded, which
+// is sorted; the check is skipped for IDs outside its range
+EntryTotals sumEntriesExcept(size_t first, size_t last, const vector<int32_t>& excluded) {
+    EntryTotals totals;
+    const int32_t* ids = milkEntries.customerId.data();
+    const int32_t* morning = milkEntries.morningMl.data();
+    const int32_t* evening = milkEntries.eveningMl.data();
+    const int32_t* amount = milkEntries.amountPaise.data();
+    int32_t lowest = excluded.front();
+    int32_t highest = excluded.back();
+    
+    for (size_t i = first; i < last; ++i) {
+        if (ids[i] >= lowest && ids[i] <= highest && binary_search(excluded.begin(), excluded.end(), ids[i])) {
+            continue;
+        }
+        totals.morningMl += morning[i];
+        totals.eveningMl += evening[i];
+        totals.amountPaise += amount[i];
+        totals.count++;
+    }
+    return totals;
+}
+
+#ifdef DAIRY_X86_SIMD
+__attribute__((target("sse2")))
+static inline __m128i sumWidenedSse2(__m128i accumulator, __m128i values) {
+    __m128i sign = _mm_srai_epi32(values, 31);
+    accumulator = _mm_add_epi64(accumulator, _mm_unpacklo_epi32(values, sign));
+    return _mm_add_epi64(accumulator, _mm_unpackhi_epi32(values, sign));
+}
+
+__attribute__((target("sse2")))
+static inline long long horizontalSumSse2(__m128i v) {
+    long long lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, v);
+    return lanes[0] + lanes[1];
+}
+
+__attribute__((target("sse2")))
+EntryTotals sumEntriesSse2(size_t first, size_t last, int32_t customerId) {
+    const int32_t* ids = milkEntries.customerId.data();
+    const int32_t* morning = milkEntries.morningMl.data();
+    const int32_t* evening = milkEntries.eveningMl.data();
+    const int32_t* amount = milkEntries.amountPaise.data();
+    
+    const __m128i target = _mm_set1_epi32(customerId);
+    const __m128i matchAll = _mm_set1_epi32(customerId == ALL_CUSTOMERS ? -1 : 0);
+    __m128i morningSum = _mm_setzero_si128();
+    __m128i eveningSum = _mm_setzero_si128();
+    __m128i amountSum = _mm_setzero_si128();
+    __m128i countSum = _mm_setzero_si128();
+    
+    size_t i = first;
+    for (; i + 4 <= last; i += 4) {
+        __m128i mask = _mm_or_si128(matchAll,
+            _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(ids + i)), target));
+        morningSum = sumWidenedSse2(morningSum, _mm_and_si128(mask, _mm_loadu_si128((const __m128i*)(morning + i))));
+        eveningSum = sumWidenedSse2(eveningSum, _mm_and_si128(mask, _mm_loadu_si128((const __m128i*)(evening + i))));
+        amountSum = sumWidenedSse2(amountSum, _mm_and_si128(mask, _mm_loadu_si128((const __m128i*)(amount + i))));
+        countSum = _mm_sub_epi64(countSum, _mm_unpacklo_epi32(mask, mask));
+        countSum = _mm_sub_epi64(countSum, _mm_unpackhi_epi32(mask, mask));
+    }
+    
+    EntryTotals totals = sumEntriesScalar(i, last, customerId);
+    totals.morningMl += horizontalSumSse2(morningSum);
+    totals.eveningMl += horizontalSumSse2(eveningSum);
+    totals.amountPaise += horizontalSumSse2(amountSum);
+    totals.count += horizontalSumSse2(countSum);
+    return totals;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i sumWidenedAvx2(__m256i accumulator, __m256i values) {
+    accumulator = _mm256_add_epi64(accumulator, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(values)));
+    return _mm256_add_epi64(accumulator, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(values, 1)));
+}
+
+__attribute__((target("avx2")))
+static inline long long horizontalSumAvx2(__m256i v) {
+    long long lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, v);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2")))
+EntryTotals sumEntriesAvx2(size_t first, size_t last, int32_t customerId) {
+    const int32_t* ids = milkEntries.customerId.data();
+    const int32_t* morning = milkEntries.morningMl.data();
+    const int32_t* evening = milkEntries.eveningMl.data();
+    const int32_t* amount = milkEntries.amountPaise.data();
+    
+    const __m256i target = _mm256_set1_epi32(customerId);
+    const __m256i matchAll = _mm256_set1_epi32(customerId == ALL_CUSTOMERS ? -1 : 0);
+    __m256i morningSum = _mm256_setzero_si256();
+    __m256i eveningSum = _mm256_setzero_si256();
+    __m256i amountSum = _mm256_setzero_si256();
+    __m256i countSum = _mm256_setzero_si256();
+    
+    size_t i = first;
+    for (; i + 8 <= last; i += 8) {
+        __m256i mask = _mm256_or_si256(matchAll,
+            _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(ids + i)), target));
+        morningSum = sumWidenedAvx2(morningSum, _mm256_and_si256(mask, _mm256_loadu_si256((const __m256i*)(morning + i))));
+        eveningSum = sumWidenedAvx2(eveningSum, _mm256_and_si256(mask, _mm256_loadu_si256((const __m256i*)(evening + i))));
+        amountSum = sumWidenedAvx2(amountSum, _mm256_and_si256(mask, _mm256_loadu_si256((const __m256i*)(amount + i))));
+        countSum = sumWidenedAvx2(countSum, mask);
+    }
+    
+    EntryTotals totals = sumEntriesScalar(i, last, customerId);
+    totals.morningMl += horizontalSumAvx2(morningSum);
+    totals.eveningMl += horizontalSumAvx2(eveningSum);
+    totals.amountPaise += horizontalSumAvx2(amountSum);
+    totals.count -= horizontalSumAvx2(countSum); // matching lanes are -1
+    return totals;
+}
+#endif
+
+// Picks the widest kernel the CPU supports, once
+EntryTotals sumEntries(size_t first, size_t last, int32_t customerId) {
+    using Kernel = EntryTotals (*)(size_t, size_t, int32_t);
+    static const Kernel kernel = []() -> Kernel {
+#ifdef DAIRY_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return sumEntriesAvx2;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return sumEntriesSse2;
+        }
+#endif
+        return sumEntriesScalar;
+    }();
+    if (customerId != ALL_CUSTOMERS) {
+        return isDeleted(customerId) ? EntryTotals() : kernel(first, last, customerId);
+    }
+    
+    if (deletedCustomers.empty()) {
+        return kernel(first, last, ALL_CUSTOMERS);
+    }
+    // Entries of deleted customers are still in the store until compaction;
+    // one pass leaves them out, however many there are
+    vector<int32_t> deleted(deletedCustomers.begin(), deletedCustomers.end());
+    sort(deleted.begin(), deleted.end());
+    return sumEntriesExcept(first, last, deleted);
+}
+
+// Adds (sign 1) or removes (sign -1) an entry's share of the rollups
+void addToRollups(const MilkEntry& entry, int sign) {
+    uint64_t key = uint64_t(uint32_t(entry.customerId)) << 32 | uint32_t(monthOf(entry.day));
+    EntryTotals totals;
+    totals.morningMl = entry.morningMl;
+    totals.eveningMl = entry.eveningMl;
+    totals.amountPaise = entry.amountPaise;
+    totals.count = 1;
+    
+    EntryTotals& daily = dailyRollups[entry.day];
+    EntryTotals& monthly = customerMonthRollups[key];
+    daily.add(totals, sign);
+    monthly.add(totals, sign);
+    if (daily.count == 0) {
+        dailyRollups.erase(entry.day);
+    }
+    if (monthly.count == 0) {
+        customerMonthRollups.erase(key);
+    }
+}
+
+// Recomputes the rollups from the resident entries, after the data files are loaded
+void rebuildRollups() {
+    dailyRollups.clear();
+    customerMonthRollups.clear();
+    for (size_t i = 0; i < milkEntries.size(); ++i) {
+        addToRollups(milkEntries[i], 1);
+    }
+    for (auto& month : partitions) {
+        month.second.rolledUp = month.second.resident;
+    }
+}
+
+EntryTotals dayTotals(int day) {
+    auto partition = partitions.find(monthOf(day));
+    if (partitionsEnabled && partition != partitions.end() && !partition->second.resident &&
+        (!partition->second.rolledUp || !deletedCustomers.empty())) {
+        // A month the server's readers could not load: add up its file instead
+        EntryTotals totals;
+        scanEntries(day, day, ALL_CUSTOMERS, [&](const MilkEntry& entry) {
+            totals.add(entry);
+            return true;
+        });
+        return totals;
+    }
+    auto pos = dailyRollups.find(day);
+    if (pos == dailyRollups.end()) {
+        return EntryTotals();
+    }
+    if (!deletedCustomers.empty()) {
+        // The rollup still counts deleted customers; sum the day's slice instead
+        auto range = entriesBetween(day, day);
+        return sumEntries(range.first, range.second, ALL_CUSTOMERS);
+    }
+    return pos->second;
+}
+
+// month is as returned by monthOf
+EntryTotals customerMonthTotals(int customerId, int month) {
+    if (isDeleted(customerId)) {
+        return EntryTotals();
+    }
+    auto pos = customerMonthRollups.find(uint64_t(uint32_t(customerId)) << 32 | uint32_t(month));
+    return pos != customerMonthRollups.end() ? pos->second : EntryTotals();
+}
+
+// Inverse of parseDate: day number back to "DD-MM-YYYY"
+string formatDate(int day) {
+    string text;
+    appendDate(text, day);
+    return text;
+}
+
+// Civil date from days (proleptic Gregorian)
+void civilFromDay(int day, int& year, int& month, int& dayOfMonth) {
+    int z = day + 719468;
+    int era = z / 146097;
+    int doe = z - era * 146097;
+    int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int mp = (5 * doy + 2) / 153;
+    dayOfMonth = doy - (153 * mp + 2) / 5 + 1;
+    month = mp < 10 ? mp + 3 : mp - 9;
+    year = yoe + era * 400 + (month <= 2);
+}
+
+// Months since January 1970, the key for monthly totals
+int monthOf(int day) {
+    int y, m, d;
+    civilFromDay(day, y, m, d);
+    return (y - 1970) * 12 + m - 1;
+}
+
+// Inverse of monthOf
+int firstDayOfMonth(int month) {
+    return dayFromCivil(1970 + month / 12, month % 12 + 1, 1);
+}
+
+void appendDate(string& out, int day) {
+    int y, m, d;
+    civilFromDay(day, y, m, d);
+    
+    char text[10] = {char('0' + d / 10), char('0' + d % 10), '-', char('0' + m / 10), char('0' + m % 10), '-',
+                     char('0' + y / 1000 % 10), char('0' + y / 100 % 10), char('0' + y / 10 % 10), char('0' + y % 10)};
+    out.append(text, sizeof(text));
+}
+
+int32_t toMillilitres(double liters) {
+    return int32_t(llround(liters * 1000));
+}
+
+double toLiters(long long millilitres) {
+    return millilitres / 1000.0;
+}
+
+double toRupees(long long paise) {
+    return paise / 100.0;
+}
+
+// Writes a fixed-point integer exactly, e.g. formatFixed(3500, 3) == "3.500"
+string formatFixed(long long value, int decimals) {
+    string text;
+    appendFixed(text, value, decimals);
+    return text;
+}
+
+// Writes a rate in the fewest digits that read back as the same double
+string formatRate(double rate) {
+    char buffer[32];
+    return string(buffer, to_chars(buffer, buffer + sizeof(buffer), rate).ptr);
+}
+
+void appendFixed(string& out, long long value, int decimals) {
+    unsigned long long scale = 1;
+    for (int i = 0; i < decimals; ++i) {
+        scale *= 10;
+    }
+    
+    if (value < 0) {
+        out += '-';
+    }
+    unsigned long long magnitude = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+    char buffer[24];
+    char* end = to_chars(buffer, buffer + sizeof(buffer), magnitude / scale).ptr;
+    out.append(buffer, end - buffer);
+    if (decimals > 0) {
+        out += '.';
+        unsigned long long fraction = magnitude % scale;
+        for (int i = decimals - 1; i >= 0; --i) {
+            buffer[i] = char('0' + fraction % 10);
+            fraction /= 10;
+        }
+        out.append(buffer, decimals);
+    }
+}
+
+// "customerId,date,morning,evening" as stored in the data and journal files
+void appendEntryFields(string& out, const MilkEntry& entry) {
+    char buffer[16];
+    char* end = to_chars(buffer, buffer + sizeof(buffer), entry.customerId).ptr;
+    out.append(buffer, end - buffer);
+    out += ',';
+    appendDate(out, entry.day);
+    out += ',';
+    appendFixed(out, entry.morningMl, 3);
+    out += ',';
+    appendFixed(out, entry.eveningMl, 3);
+}
+
+// Adds a customer, or replaces the one with the same ID
+void upsertCustomer(const Customer& customer) {
+    if (isDeleted(customer.id)) {
+        // The ID is being reused: drop the old customer's tombstoned data first
+        compactDeletedCustomers();
+    }
+    Customer* existing = findCustomer(customer.id);
+    if (existing) {
+        indexCustomerText(*existing, -1);
+        *existing = customer;
+        indexCustomerText(customer, 1);
+        return;
+    }
+    customers.push_back(customer);
+    customerIndex[customer.id] = customers.size() - 1;
+    indexCustomerText(customer, 1);
+    lastCustomerId = max(lastCustomerId, customer.id);
+}
+
+// Removes a customer together with all of their milk entries. Only a
+// tombstone is written here; the data goes at the next compaction. A replayed
+// deletion may find the record already gone from customers.dat while its
+// entries are still in the store, so the ID is tombstoned either way.
+void removeCustomer(int id) {
+    if (const Customer* customer = findCustomer(id)) {
+        indexCustomerText(*customer, -1);
+    }
+    deletedCustomers.insert(id);
+    lastCustomerId = max(lastCustomerId, id);
+}
+
+bool isDeleted(int customerId) {
+    return !deletedCustomers.empty() && deletedCustomers.count(customerId) != 0;
+}
+
+bool hasEntries() {
+    return !milkEntries.empty() || !partitions.empty();
+}
+
+static string partitionPath(int month, bool archived = false) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s/%04d-%02d.%s", PARTITION_DIR, 1970 + month / 12, month % 12 + 1, 
+             archived ? "arc" : "dat");
+    return name;
+}
+
+// Recognises a month file name, YYYY-MM.dat or YYYY-MM.arc
+static bool parsePartitionName(const string& name, int& month, bool& archived) {
+    int year, monthOfYear;
+    char extension[4];
+    char extra;
+    if (sscanf(name.c_str(), "%4d-%2d.%3[a-z]%c", &year, &monthOfYear, extension, &extra) != 3 ||
+        year < 1970 || monthOfYear < 1 || monthOfYear > 12) {
+        return false;
+    }
+    archived = strcmp(extension, "arc") == 0;
+    month = (year - 1970) * 12 + monthOfYear - 1;
+    return archived || strcmp(extension, "dat") == 0;
+}
+
+// Months whose files may still hold entries of deleted customers: every
+// month on disk, other than changed ones, which the next save writes whole
+vector<pair<int, bool>> compactableMonths() {
+    vector<pair<int, bool>> months;
+    for (const auto& month : partitions) {
+        if (month.second.onDisk && !month.second.dirty) {
+            months.emplace_back(month.first, month.second.archived);
+        }
+    }
+    return months;
+}
+
+// Rewrites the files of months, given as (month, archived), without the
+// entries of deleted customers. One month is read at a time and none is
+// loaded; a file left empty is removed. Each rewritten file is added to
+// compacted as (month, emptied). Reads nothing but the files.
+bool compactMonthFiles(const unordered_set<int>& deleted, const vector<pair<int, bool>>& months,
+                       vector<pair<int, bool>>& compacted) {
+    bool ok = true;
+    vector<MilkEntry> rows;
+    EntryColumns kept;
+    for (const auto& month : months) {
+        string path = partitionPath(month.first, month.second);
+        rows.clear();
+        uint64_t seq = 0;
+        if (!(month.second ? readArchiveFile(path, ALL_CUSTOMERS, 0, LAST_DAY, rows, seq) 
+                           : readEntryFile(path, rows, seq))) {
+            cout << "Error reading " << path << "!\n";
+            ok = false;
+            continue;
+        }
+        size_t before = rows.size();
+        rows.erase(remove_if(rows.begin(), rows.end(), [&](const MilkEntry& entry) {
+            return deleted.count(entry.customerId) != 0;
+        }), rows.end());
+        if (rows.size() == before) {
+            continue;
+        }
+        
+        // The file keeps its sequence number: only rows the journal deletes are gone
+        bool written;
+        if (rows.empty()) {
+            written = remove(path.c_str()) == 0;
+        } else {
+            kept.assign(rows);
+            written = month.second ? writeArchiveFile(path, kept, 0, kept.size(), seq)
+                                   : writeEntryFile(path, kept, 0, kept.size(), seq);
+        }
+        ok = written && ok;
+        if (written) {
+            compacted.emplace_back(month.first, rows.empty());
+        }
+    }
+    return ok;
+}
+
+// Removes deleted customers and their resident entries from memory, once
+// their month files no longer hold them. The rollups of the compacted months
+// are counted again, from the resident entries or when the month next loads.
+void dropDeletedCustomers(const unordered_set<int>& deleted, const vector<pair<int, bool>>& compacted) {
+    unordered_set<int> recount;
+    for (const auto& month : compacted) {
+        recount.insert(month.first);
+        auto partition = partitions.find(month.first);
+        if (partition != partitions.end() && month.second) {
+            partition->second.onDisk = false;
+        }
+    }
+    milkEntries.filter([&](const MilkEntry& entry) {
+        if (deleted.count(entry.customerId) == 0) {
+            return true;
+        }
+        if (recount.count(monthOf(entry.day)) == 0) {
+            addToRollups(entry, -1);
+        }
+        return false;
+    });
+    
+    if (!recount.empty()) {
+        for (auto it = dailyRollups.begin(); it != dailyRollups.end();) {
+            it = recount.count(monthOf(it->first)) ? dailyRollups.erase(it) : next(it);
+        }
+        for (auto it = customerMonthRollups.begin(); it != customerMonthRollups.end();) {
+            it = recount.count(int(uint32_t(it->first))) ? customerMonthRollups.erase(it) : next(it);
+        }
+        for (int month : recount) {
+            Partition& partition = partitions[month];
+            if (partition.resident) {
+                auto range = entriesBetween(firstDayOfMonth(month), firstDayOfMonth(month + 1) - 1);
+                for (size_t i = range.first; i < range.second; ++i) {
+                    addToRollups(milkEntries[i], 1);
+                }
+            }
+            partition.rolledUp = partition.resident;
+        }
+    }
+    
+    customers.erase(remove_if(customers.begin(), customers.end(),
+                              [&](const Customer& customer) { return deleted.count(customer.id) != 0; }),
+                    customers.end());
+    for (int id : deleted) {
+        rateHistory.erase(id);
+        deletedCustomers.erase(id);
+    }
+    // Their words left the search index when they were deleted
+    customerIndex.clear();
+    customerIndex.reserve(customers.size());
+    for (size_t i = 0; i < customers.size(); ++i) {
+        customerIndex[customers[i].id] = i;
+    }
+}
+
+// Physically removes tombstoned customers and their entries: the resident
+// store in one pass, and each month file in turn without loading it, so
+// memory stays within the resident months
+void compactDeletedCustomers() {
+    finishBackgroundSave(true);
+    if (deletedCustomers.empty()) {
+        return;
+    }
+    StatTimer timer(STAT_COMPACT);
+    unordered_set<int> deleted = deletedCustomers;
+    vector<pair<int, bool>> compacted;
+    compactMonthFiles(deleted, compactableMonths(), compacted);
+    dropDeletedCustomers(deleted, compacted);
+}
+
+// Merges a month's file into milkEntries; its slice of the store is empty
+static void loadPartition(int month, Partition& partition) {
+    StatTimer timer(STAT_PARTITION_LOAD);
+    vector<MilkEntry> rows;
+    uint64_t seq = 0;
+    if (partition.onDisk && partition.archived) {
+        readArchiveFile(partitionPath(month, true), ALL_CUSTOMERS, 0, LAST_DAY, rows, seq);
+        stable_sort(rows.begin(), rows.end(), [](const MilkEntry& a, const MilkEntry& b) { return a.day < b.day; });
+    } else if (partition.onDisk) {
+        readEntryFile(partitionPath(month), rows, seq);
+    }
+    bool repriced = repriceStaleRows(rows, seq) > 0;
+    const vector<int32_t>& days = milkEntries.day;
+    size_t pos = lower_bound(days.begin(), days.end(), firstDayOfMonth(month)) - days.begin();
+    milkEntries.insertRows(pos, rows);
+    
+    if (!partition.rolledUp) {
+        for (const auto& entry : rows) {
+            addToRollups(entry, 1);
+        }
+        partition.rolledUp = true;
+    }
+    partition.seq = seq;
+    partition.resident = true;
+    if (repriced) {
+        markPartitionDirty(firstDayOfMonth(month));
+    }
+}
+
+// Makes every month overlapping startDay..endDay resident
+void loadPartitions(int startDay, int endDay) {
+    if (!partitionsEnabled || partitionsPinned || partitions.empty() || startDay > endDay) {
+        return;
+    }
+    auto first = partitions.lower_bound(monthOf(max(0, startDay)));
+    auto last = partitions.upper_bound(monthOf(min(endDay, LAST_DAY)));
+    for (auto it = first; it != last; ++it) {
+        it->second.lastUse = ++partitionClock;
+        if (!it->second.resident) {
+            loadPartition(it->first, it->second);
+        }
+    }
+}
+
+// Drops the least recently used unchanged months, other than the current
+// one, until no more than residentMonthLimit are resident
+void trimPartitions() {
+    if (!partitionsEnabled || partitionsPinned) {
+        return;
+    }
+    int currentMonth = monthOf(parseDate(getCurrentDate()));
+    size_t resident = 0;
+    for (const auto& month : partitions) {
+        resident += month.second.resident;
+    }
+    
+    while (resident > residentMonthLimit) {
+        auto victim = partitions.end();
+        for (auto it = partitions.begin(); it != partitions.end(); ++it) {
+            if (it->second.resident && !it->second.dirty && it->first != currentMonth &&
+                (victim == partitions.end() || it->second.lastUse < victim->second.lastUse)) {
+                victim = it;
+            }
+        }
+        if (victim == partitions.end()) {
+            return;
+        }
+        auto range = entriesBetween(firstDayOfMonth(victim->first), firstDayOfMonth(victim->first + 1) - 1);
+        milkEntries.erase(range.first, range.second);
+        victim->second.resident = false;
+        --resident;
+    }
+}
+
+// Notes that the month holding day has changed in memory
+void markPartitionDirty(int day) {
+    if (!partitionsEnabled) {
+        return;
+    }
+    Partition& partition = partitions[monthOf(day)];
+    if (!partition.resident) {
+        // A month new to the store: its entries are already in the rollups
+        partition.resident = true;
+        partition.rolledUp = true;
+    }
+    partition.dirty = true;
+    partition.version++;
+    partition.lastUse = ++partitionClock;
+}
+
+// Takes the whole resident store as the partitions, for a store loaded from
+// the CSV files or the snapshot, or generated. Files of other months are
+// removed at the next save.
+void adoptResidentEntries() {
+    partitions.clear();
+    for (size_t i = 0; i < milkEntries.size(); ++i) {
+        if (i == 0 || monthOf(milkEntries.day[i]) != monthOf(milkEntries.day[i - 1])) {
+            markPartitionDirty(milkEntries.day[i]);
+        }
+    }
+}
+
+// Writes the changed months. The sequence number file goes first: it must
+// never be behind a partition file, or new journal records could be taken
+// for ones a partition already holds.
+bool savePartitions(const DataImage& image) {
+    error_code error;
+    filesystem::create_directories(PARTITION_DIR, error);
+    ofstream seqFile(string(PARTITION_SEQ_FILE) + ".tmp");
+    seqFile << "#seq," << image.journalSeq << "\n";
+    seqFile.close();
+    if (!seqFile || !replaceFile(string(PARTITION_SEQ_FILE) + ".tmp", PARTITION_SEQ_FILE)) {
+        cout << "Error saving " << PARTITION_SEQ_FILE << "!\n";
+        return false;
+    }
+    
+    // The image holds the changed months back to back; an empty one loses its
+    // file. A month's new file is in place before its other format is removed.
+    bool ok = true;
+    size_t first = 0;
+    for (const auto& month : image.months) {
+        const vector<int32_t>& days = image.entries.day;
+        size_t last = lower_bound(days.begin() + first, days.end(), firstDayOfMonth(month.first + 1)) - days.begin();
+        bool archived = month.first < image.archiveBefore;
+        bool written = true;
+        if (last > first) {
+            string path = partitionPath(month.first, archived);
+            written = archived ? writeArchiveFile(path, image.entries, first, last, image.journalSeq)
+                               : writeEntryFile(path, image.entries, first, last, image.journalSeq);
+            ok = written && ok;
+        } else {
+            remove(partitionPath(month.first, archived).c_str());
+        }
+        if (written) {
+            remove(partitionPath(month.first, !archived).c_str());
+        }
+        first = last;
+    }
+    
+    // Remove files of months no longer in the store
+    for (const auto& file : filesystem::directory_iterator(PARTITION_DIR, error)) {
+        int month;
+        bool archived;
+        if (parsePartitionName(file.path().filename().string(), month, archived) &&
+            !binary_search(image.knownMonths.begin(), image.knownMonths.end(), month)) {
+            filesystem::remove(file.path(), error);
+        }
+    }
+    return ok;
+}
+
+// Loads customers.dat and the current month of the partitioned store. Returns
+// false if there is no partitioned store yet.
+bool loadPartitionedStore() {
+    error_code error;
+    if (!filesystem::is_directory(PARTITION_DIR, error)) {
+        return false;
+    }
+    loadCustomerFile();
+    
+    string contents;
+    if (readFile(PARTITION_SEQ_FILE, contents) && contents.compare(0, 5, "#seq,") == 0) {
+        from_chars(contents.data() + 5, contents.data() + contents.size(), journalSeq);
+    }
+    
+    partitions.clear();
+    vector<int> bothFormats;
+    for (const auto& file : filesystem::directory_iterator(PARTITION_DIR, error)) {
+        int month;
+        bool archived;
+        if (parsePartitionName(file.path().filename().string(), month, archived)) {
+            Partition& partition = partitions[month];
+            if (partition.onDisk) {
+                bothFormats.push_back(month);
+            }
+            partition.onDisk = true;
+            partition.archived = partition.archived || archived;
+        }
+    }
+    
+    // A save that changed a month's format stopped before removing the old
+    // file: keep whichever is newer
+    for (int month : bothFormats) {
+        vector<MilkEntry> rows;
+        uint64_t archiveSeq = 0, csvSeq = 0;
+        bool archiveOk = readArchiveFile(partitionPath(month, true), ALL_CUSTOMERS, 0, -1, rows, archiveSeq);
+        ifstream csv(partitionPath(month));
+        string firstLine;
+        if (getline(csv, firstLine) && firstLine.compare(0, 5, "#seq,") == 0) {
+            from_chars(firstLine.data() + 5, firstLine.data() + firstLine.size(), csvSeq);
+        }
+        partitions[month].archived = archiveOk && archiveSeq >= csvSeq;
+        remove(partitionPath(month, !partitions[month].archived).c_str());
+    }
+    
+    int today = parseDate(getCurrentDate());
+    loadPartitions(today, today);
+    return true;
+}
+
+// Streams the entries between startDay and endDay, of one customer or of
+// ALL_CUSTOMERS, to visit in date order, skipping deleted customers. Resident
+// months are read in place. Other months are read from their files one at a
+// time into a buffer and not loaded, so a scan over the whole history needs
+// memory for one month at most and leaves the resident months as they were.
+// The first skip matching entries are passed over, and visit returns false to
+// stop the scan, so a page of a large result costs no more than its rows.
+// Given totals, every matching entry in the range is added to it, skipped or
+// not, and the scan goes on after a stop to finish them: resident months are
+// summed in place by the sumEntries kernels, the rest from the rows read.
+// Returns false if visit stopped it.
+template <typename Visit>
+bool scanEntries(int startDay, int endDay, int32_t customerId, Visit visit, size_t skip, EntryTotals* totals) {
+    startDay = max(0, startDay);
+    endDay = min(endDay, LAST_DAY);
+    if (startDay > endDay || (customerId != ALL_CUSTOMERS && isDeleted(customerId))) {
+        return true;
+    }
+    auto wanted = [customerId](int32_t id) {
+        return customerId == ALL_CUSTOMERS ? !isDeleted(id) : id == customerId;
+    };
+    bool stopped = false;
+    auto visitRow = [&](const MilkEntry& entry) {
+        if (skip > 0) {
+            --skip;
+        } else if (!visit(entry)) {
+            stopped = true;
+        }
+    };
+    auto visitResident = [&](int from, int to) {
+        auto range = entriesBetween(from, to);
+        if (totals) {
+            totals->add(sumEntries(range.first, range.second, customerId));
+        }
+        if (customerId == ALL_CUSTOMERS && deletedCustomers.empty()) {
+            // Every row matches, so skipped rows are passed over by position
+            size_t jump = min(skip, range.second - range.first);
+            range.first += jump;
+            skip -= jump;
+        }
+        for (size_t i = range.first; i < range.second && !stopped; ++i) {
+            if (wanted(milkEntries.customerId[i])) {
+                visitRow(milkEntries[i]);
+            }
+        }
+    };
+    if (!partitionsEnabled) {
+        visitResident(startDay, endDay);
+        return !stopped;
+    }
+    
+    vector<MilkEntry> rows;
+    auto last = partitions.upper_bound(monthOf(endDay));
+    for (auto it = partitions.lower_bound(monthOf(startDay)); it != last && !(stopped && !totals); ++it) {
+        int from = max(startDay, firstDayOfMonth(it->first));
+        int to = min(endDay, firstDayOfMonth(it->first + 1) - 1);
+        if (it->second.resident || !it->second.onDisk) {
+            visitResident(from, to);
+            continue;
+        }
+        
+        rows.clear();
+        uint64_t seq;
+        if (it->second.archived) {
+            // Only the blocks that can match are read; all customers come out
+            // in customer order and are put back in date order
+            readArchiveFile(partitionPath(it->first, true), customerId, from, to, rows, seq);
+            if (customerId == ALL_CUSTOMERS) {
+                stable_sort(rows.begin(), rows.end(), [](const MilkEntry& a, const MilkEntry& b) { return a.day < b.day; });
+            }
+        } else {
+            readEntryFile(partitionPath(it->first), rows, seq);
+        }
+        repriceStaleRows(rows, seq);
+        for (const auto& entry : rows) {
+            if (entry.day < from || entry.day > to || !wanted(entry.customerId)) {
+                continue;
+            }
+            if (totals) {
+                totals->add(entry);
+            }
+            if (!stopped) {
+                visitRow(entry);
+            }
+        }
+    }
+    return !stopped;
+}
+
+// The archive command: rewrites every month older than the archive age as an
+// archive file now, rather than when it next changes
+int archiveStore() {
+    if (archiveAfterMonths == 0) {
+        cout << "Archiving is off (DAIRY_ARCHIVE_MONTHS=0).\n";
+        return 1;
+    }
+    partitionsEnabled = true;
+    loadDataFromFile();
+    openJournal();
+    int archiveBefore = monthOf(parseDate(getCurrentDate())) - archiveAfterMonths;
+    
+    int months = 0;
+    size_t entries = 0;
+    for (auto& month : partitions) {
+        if (month.first < archiveBefore && !month.second.archived) {
+            loadPartitions(firstDayOfMonth(month.first), firstDayOfMonth(month.first));
+            auto range = entriesBetween(firstDayOfMonth(month.first), firstDayOfMonth(month.first + 1) - 1);
+            markPartitionDirty(firstDayOfMonth(month.first));
+            entries += range.second - range.first;
+            ++months;
+        }
+    }
+    checkpoint();
+    
+    error_code error;
+    uint64_t archiveBytes = 0;
+    for (const auto& month : partitions) {
+        if (month.first < archiveBefore && month.second.archived) {
+            archiveBytes += filesystem::file_size(partitionPath(month.first, true), error);
+        }
+    }
+    cout << "Archived " << months << " month(s), " << entries << " entries. Archive files now take "
+         << archiveBytes << " bytes.\n";
+    return 0;
+}
+
+// Journal settings come from the environment:
+//   DAIRY_JOURNAL_FSYNC       fsync after every N records (default 1, 0 = never)
+//   DAIRY_CHECKPOINT_EVERY    save the data files after N records (default 10000)
+//   DAIRY_SAVE_INTERVAL       also save every N seconds of changes (default 300, 0 = off);
+//                             saves run in the background
+//   DAIRY_SNAPSHOT            1 saves the binary snapshot instead of the CSV files
+//   DAIRY_STATS_FILE          write the operation statistics to this file on exit
+//   DAIRY_PARTITIONS          1 keeps entries in month files under entries/, loaded
+//                             as needed (also on whenever that directory exists)
+//   DAIRY_RESIDENT_MONTHS     months of entries kept in memory (default 6)
+//   DAIRY_ARCHIVE_MONTHS      save months older than N months as packed archives
+//                             (default 12, 0 = never)
+void configureJournal() {
+    if (const char* value = getenv("DAIRY_JOURNAL_FSYNC")) {
+        journalFsyncEvery = max(0, atoi(value));
+    }
+    if (const char* value = getenv("DAIRY_CHECKPOINT_EVERY")) {
+        checkpointEvery = max(1, atoi(value));
+    }
+    if (const char* value = getenv("DAIRY_SAVE_INTERVAL")) {
+        saveIntervalSeconds = max(0, atoi(value));
+    }
+    if (const char* value = getenv("DAIRY_SNAPSHOT")) {
+        snapshotEnabled = atoi(value) != 0;
+    }
+    if (const char* value = getenv("DAIRY_STATS_FILE")) {
+        statsFile = value;
+    }
+    if (const char* value = getenv("DAIRY_PARTITIONS")) {
+        partitionsEnabled = atoi(value) != 0;
+    }
+    error_code error;
+    partitionsEnabled = partitionsEnabled || filesystem::is_directory(PARTITION_DIR, error);
+    if (const char* value = getenv("DAIRY_RESIDENT_MONTHS")) {
+        residentMonthLimit = size_t(max(1, atoi(value)));
+    }
+    if (const char* value = getenv("DAIRY_ARCHIVE_MONTHS")) {
+        archiveAfterMonths = max(0, atoi(value));
+    }
+}
+
+void openJournal() {
+    journalFile = fopen(JOURNAL_FILE, "ab");
+    if (!journalFile) {
+        cout << "Warning: cannot open " << JOURNAL_FILE << ", changes are only saved on exit!\n";
+    }
+}
+
+// Appends one change to the journal; the caller has already applied it
+void journalRecord(const string& record) {
+    ++journalSeq;
+    journalWrite(to_string(journalSeq) + "," + record + "\n", 1);
+}
+
+// Writes already numbered journal lines holding count records
+void journalWrite(const string& lines, int count) {
+    if (!journalFile) {
+        return;
+    }
+    
+    {
+        StatTimer timer(STAT_JOURNAL_WRITE);
+        fwrite(lines.data(), 1, lines.size(), journalFile);
+        fflush(journalFile);
+        countStat(STAT_BYTES_WRITTEN, lines.size());
+        
+        journalUnsynced += count;
+        if (journalFsyncEvery > 0 && journalUnsynced >= journalFsyncEvery) {
+            syncFile(journalFile);
+            journalUnsynced = 0;
+        }
+    }
+    
+    // backgroundSaveTick starts a save once checkpointEvery records are in;
+    // a save is never started from here, in the middle of an operation
+    journalSinceCheckpoint += count;
+}
+
+void journalCustomer(char type, const Customer& customer) {
+    stringstream ss;
+    ss << type << "," << customer.id << "," << customer.name << "," 
+       << customer.address << "," << customer.phone << "," << formatRate(customer.rate);
+    journalRecord(ss.str());
+}
+
+string entryRecord(const MilkEntry& entry) {
+    string record = "E,";
+    appendEntryFields(record, entry);
+    record += ',';
+    appendFixed(record, entry.amountPaise, 2);
+    return record;
+}
+
+void journalEntry(const MilkEntry& entry) {
+    journalRecord(entryRecord(entry));
+}
+
+// Group commit: the whole batch goes out in one write and at most one fsync
+void journalEntries(const vector<MilkEntry>& entries) {
+    string lines;
+    lines.reserve(entries.size() * 48);
+    char buffer[24];
+    for (const auto& entry : entries) {
+        char* end = to_chars(buffer, buffer + sizeof(buffer), ++journalSeq).ptr;
+        lines.append(buffer, end - buffer);
+        lines += ",E,";
+        appendEntryFields(lines, entry);
+        lines += ',';
+        appendFixed(lines, entry.amountPaise, 2);
+        lines += '\n';
+    }
+    journalWrite(lines, int(entries.size()));
+}
+
+// Applies the records of one journal file; see replayJournal
+static int replayJournalFile(const char* path, uint64_t afterSeq) {
+    ifstream journal(path);
+    int applied = 0;
+    string line;
+    while (getline(journal, line)) {
+        stringstream ss(line);
+        string token;
+        vector<string> tokens;
+        
+        while (getline(ss, token, ',')) {
+            tokens.push_back(token);
+        }
+        
+        if (tokens.size() < 3 || tokens[1].size() != 1) {
+            continue;
+        }
+        
+        try {
+            uint64_t seq = stoull(tokens[0]);
+            char type = tokens[1][0];
+            // Customer records are re-applied even when older than the data
+            // files, as a failed save may have written only some of them
+            bool stale = seq <= afterSeq;
+            if (stale && type == 'E') {
+                continue;
+            }
+            
+            if ((type == 'C' || type == 'U') && tokens.size() == 7) {
+                Customer customer;
+                customer.id = stoi(tokens[2]);
+                customer.name = tokens[3];
+                customer.address = tokens[4];
+                customer.phone = tokens[5];
+                customer.rate = stod(tokens[6]);
+                upsertCustomer(customer);
+            } else if (type == 'D' && tokens.size() == 3) {
+                removeCustomer(stoi(tokens[2]));
+            } else if (type == 'R' && tokens.size() == 5) {
+                Customer* customer = findCustomer(stoi(tokens[2]));
+                int fromDay = parseDate(tokens[3]);
+                if (!customer || fromDay < 0) {
+                    continue;
+                }
+                setRate(*customer, fromDay, stod(tokens[4]), seq, false);
+            } else if (type == 'E' && tokens.size() == 7) {
+                MilkEntry entry;
+                entry.customerId = stoi(tokens[2]);
+                entry.day = parseDate(tokens[3]);
+                if (entry.day < 0) {
+                    continue;
+                }
+                entry.morningMl = toMillilitres(stod(tokens[4]));
+                entry.eveningMl = toMillilitres(stod(tokens[5]));
+                entry.amountPaise = int32_t(llround(stod(tokens[6]) * 100));
+                // Skip entries already in their month's partition file
+                loadPartitions(entry.day, entry.day);
+                auto partition = partitions.find(monthOf(entry.day));
+                if (partition != partitions.end() && seq <= partition->second.seq) {
+                    journalSeq = seq;
+                    continue;
+                }
+                insertMilkEntry(entry);
+            } else {
+                continue;
+            }
+            
+            if (!stale) {
+                journalSeq = seq;
+                ++applied;
+            }
+        } catch (const exception&) {
+            // Torn or corrupt record
+        }
+    }
+    return applied;
+}
+
+// Applies journal records with a sequence number above afterSeq and returns
+// how many were applied. The segment of an unfinished background save comes
+// first. A torn record at the end of a file is ignored.
+int replayJournal(uint64_t afterSeq) {
+    int applied = replayJournalFile(OLD_JOURNAL_FILE, afterSeq);
+    return applied + replayJournalFile(JOURNAL_FILE, afterSeq);
+}
+
+// Writes the data files and starts an empty journal. Returns false, keeping
+// the journal, if the files could not be written.
+bool checkpoint() {
+    finishBackgroundSave(true);
+    if (!saveDataToFile()) {
+        // Keep the journal: it still holds the changes
+        cout << "Error: could not save the data files; changes are kept in " << JOURNAL_FILE << "\n";
+        journalSinceCheckpoint = 0;
+        return false;
+    }
+    
+    if (journalFile) {
+        fclose(journalFile);
+    }
+    journalFile = fopen(JOURNAL_FILE, "wb");
+    if (journalFile) {
+        syncFile(journalFile);
+    }
+    remove(OLD_JOURNAL_FILE);
+    journalUnsynced = 0;
+    journalSinceCheckpoint = 0;
+    lastSaveStarted = chrono::steady_clock::now();
+    return true;
+}
+
+// Starts writing the data files on a worker thread. Falls back to a
+// checkpoint when the journal cannot be rotated, and returns whether the
+// save is still running.
+bool startBackgroundSave() {
+    finishBackgroundSave(false);
+    if (saveThread.joinable()) {
+        return true;
+    }
+    
+    error_code error;
+    if (!journalFile || filesystem::exists(OLD_JOURNAL_FILE, error)) {
+        checkpoint();
+        return false;
+    }
+    
+    savingImage = make_unique<DataImage>(captureImage(partitionsEnabled));
+    
+    // Changes from here on go to a fresh journal; the old one covers the image
+    fclose(journalFile);
+    journalFile = nullptr;
+    if (!replaceFile(JOURNAL_FILE, OLD_JOURNAL_FILE)) {
+        openJournal();
+        savingImage.reset();
+        checkpoint();
+        return false;
+    }
+    openJournal();
+    journalUnsynced = 0;
+    journalSinceCheckpoint = 0;
+    lastSaveStarted = chrono::steady_clock::now();
+    
+    saveFinished = false;
+    saveThread = thread([]() {
+        saveSucceeded = writeDataFiles(*savingImage);
+        saveFinished = true;
+    });
+    return true;
+}
+
+// Collects a finished background save, waiting for it if asked
+void finishBackgroundSave(bool wait) {
+    if (!saveThread.joinable() || (!wait && !saveFinished)) {
+        return;
+    }
+    saveThread.join();
+    if (saveSucceeded) {
+        applySavedImage(*savingImage);
+        remove(OLD_JOURNAL_FILE);
+    } else {
+        // The next checkpoint saves everything and replaces both journals
+        cout << "Error: background save failed; changes are kept in " << OLD_JOURNAL_FILE << "\n";
+    }
+    savingImage.reset();
+}
+
+// Called between operations: collects a finished save and starts the next
+// one once checkpointEvery records are in the journal, or the save interval
+// has passed with changes in it
+void backgroundSaveTick() {
+    finishBackgroundSave(false);
+    if (journalSinceCheckpoint == 0 || saveThread.joinable()) {
+        return;
+    }
+    if (journalSinceCheckpoint >= checkpointEvery ||
+        (saveIntervalSeconds > 0 &&
+         chrono::steady_clock::now() - lastSaveStarted >= chrono::seconds(saveIntervalSeconds))) {
+        startBackgroundSave();
+    }
+}
+
+void discardJournal() {
+    finishBackgroundSave(true);
+    if (journalFile) {
+        fclose(journalFile);
+        journalFile = nullptr;
+    }
+    remove(JOURNAL_FILE);
+    remove(OLD_JOURNAL_FILE);
+}
+
+// Flushes a file through to the disk
+void syncFile(FILE* file) {
+    fflush(file);
+#ifdef _WIN32
+    _commit(_fileno(file));
+#else
+    fsync(fileno(file));
+#endif
+}
+
+// Moves a fully written file over the old copy, syncing it to disk first
+bool replaceFile(const string& from, const string& to) {
+    if (FILE* file = fopen(from.c_str(), "ab")) {
+        syncFile(file);
+        fclose(file);
+    }
+    
+    error_code error;
+    filesystem::rename(from, to, error);
+    if (error) {
+        cout << "Error replacing " << to << ": " << error.message() << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Word-at-a-time FNV-1a style checksum; len must be a multiple of 8
+uint64_t snapshotChecksum(uint64_t hash, const void* data, size_t len) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Writes one section padded to 8 bytes and folds it into the checksum
+static bool writeSnapshotSection(FILE* file, uint64_t& checksum, const void* data, size_t len) {
+    static const char zeros[8] = {0};
+    size_t padding = (8 - len % 8) % 8;
+    if (fwrite(data, 1, len, file) != len || fwrite(zeros, 1, padding, file) != padding) {
+        return false;
+    }
+    
+    size_t whole = len - len % 8;
+    checksum = snapshotChecksum(checksum, data, whole);
+    if (padding > 0) {
+        char tail[8] = {0};
+        memcpy(tail, (const char*)data + whole, len % 8);
+        checksum = snapshotChecksum(checksum, tail, 8);
+    }
+    return true;
+}
+
+bool writeSnapshot(const string& path, const DataImage& image) {
+    string tempPath = path + ".tmp";
+    FILE* file = fopen(tempPath.c_str(), "wb");
+    if (!file) {
+        cout << "Error writing " << path << "!\n";
+        return false;
+    }
+    StatTimer timer(STAT_FILE_WRITE);
+    
+    vector<SnapshotCustomer> records;
+    string text;
+    records.reserve(image.customers.size());
+    for (const auto& customer : image.customers) {
+        SnapshotCustomer record = {};
+        record.id = customer.id;
+        record.nameLength = uint32_t(customer.name.size());
+        record.addressLength = uint32_t(customer.address.size());
+        record.phoneLength = uint32_t(customer.phone.size());
+        record.textOffset = text.size();
+        record.rate = customer.rate;
+        text += customer.name;
+        text += customer.address;
+        text += customer.phone;
+        records.push_back(record);
+    }
+    
+    SnapshotHeader header = {};
+    memcpy(header.magic, "DAIRYSNP", 8);
+    header.version = SNAPSHOT_VERSION;
+    header.headerSize = sizeof(SnapshotHeader);
+    header.journalSeq = image.journalSeq;
+    header.customerCount = records.size();
+    header.entryCount = image.entries.size();
+    header.textBytes = (text.size() + 7) / 8 * 8;
+    
+    // Header is rewritten with the checksum once the payload is out
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    uint64_t checksum = 0xcbf29ce484222325ULL;
+    const EntryColumns& entries = image.entries;
+    size_t columnBytes = entries.size() * sizeof(int32_t);
+    ok = ok && writeSnapshotSection(file, checksum, records.data(), records.size() * sizeof(SnapshotCustomer));
+    ok = ok && writeSnapshotSection(file, checksum, text.data(), text.size());
+    ok = ok && writeSnapshotSection(file, checksum, entries.customerId.data(), columnBytes);
+    ok = ok && writeSnapshotSection(file, checksum, entries.day.data(), columnBytes);
+    ok = ok && writeSnapshotSection(file, checksum, entries.morningMl.data(), columnBytes);
+    ok = ok && writeSnapshotSection(file, checksum, entries.eveningMl.data(), columnBytes);
+    ok = ok && writeSnapshotSection(file, checksum, entries.amountPaise.data(), columnBytes);
+    
+    header.checksum = checksum;
+    countStat(STAT_BYTES_WRITTEN, uint64_t(max(0L, ftell(file))));
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+    
+    if (!ok) {
+        cout << "Error writing " << path << "!\n";
+        remove(tempPath.c_str());
+        return false;
+    }
+    return replaceFile(tempPath, path);
+}
+
+// Maps a snapshot and copies its sections straight into the stores. Returns
+// false when there is no usable snapshot, so the caller falls back to CSV.
+bool loadSnapshot(const string& path) {
+    const char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    vector<char> buffer;
+    ifstream in(path, ios::binary | ios::ate);
+    if (!in) {
+        return false;
+    }
+    buffer.resize(size_t(in.tellg()));
+    in.seekg(0);
+    in.read(buffer.data(), buffer.size());
+    data = buffer.data();
+    size = buffer.size();
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(SnapshotHeader)) {
+        close(fd);
+        cout << "Warning: " << path << " is damaged, loading CSV files instead.\n";
+        return false;
+    }
+    size = size_t(info.st_size);
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    data = (const char*)mapping;
+#endif
+    countStat(STAT_BYTES_READ, size);
+    
+    SnapshotHeader header;
+    bool ok = size >= sizeof(header);
+    if (ok) {
+        memcpy(&header, data, sizeof(header));
+        ok = memcmp(header.magic, "DAIRYSNP", 8) == 0 && header.version == SNAPSHOT_VERSION
+             && header.headerSize == sizeof(SnapshotHeader);
+    }
+    
+    size_t customerBytes = 0, columnBytes = 0, paddedColumn = 0;
+    if (ok) {
+        customerBytes = header.customerCount * sizeof(SnapshotCustomer);
+        columnBytes = header.entryCount * sizeof(int32_t);
+        paddedColumn = (columnBytes + 7) / 8 * 8;
+        ok = size == sizeof(header) + customerBytes + header.textBytes + 5 * paddedColumn
+             && snapshotChecksum(0xcbf29ce484222325ULL, data + sizeof(header), size - sizeof(header)) == header.checksum;
+    }
+    
+    if (ok) {
+        const char* cursor = data + sizeof(header);
+        const char* text = cursor + customerBytes;
+        customers.clear();
+        customers.reserve(header.customerCount);
+        for (uint64_t i = 0; i < header.customerCount; ++i) {
+            SnapshotCustomer record;
+            memcpy(&record, cursor + i * sizeof(record), sizeof(record));
+            const char* fields = text + record.textOffset;
+            Customer customer;
+            customer.id = record.id;
+            customer.name = string_view(fields, record.nameLength);
+            customer.address = string_view(fields + record.nameLength, record.addressLength);
+            customer.phone = string_view(fields + record.nameLength + record.addressLength, record.phoneLength);
+            customer.rate = record.rate;
+            customers.push_back(customer);
+        }
+        rebuildCustomerIndex();
+        
+        cursor = text + header.textBytes;
+        vector<int32_t>* columns[] = {&milkEntries.customerId, &milkEntries.day, &milkEntries.morningMl, 
+                                      &milkEntries.eveningMl, &milkEntries.amountPaise};
+        for (vector<int32_t>* column : columns) {
+            column->resize(header.entryCount);
+            memcpy(column->data(), cursor, columnBytes);
+            cursor += paddedColumn;
+        }
+        journalSeq = header.journalSeq;
+    } else {
+        cout << "Warning: " << path << " is damaged, loading CSV files instead.\n";
+    }
+    
+#ifndef _WIN32
+    munmap((void*)data, size);
+#endif
+    return ok;
+}
+
+static void putVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += char(value | 0x80);
+        value >>= 7;
+    }
+    out += char(value);
+}
+
+static bool getVarint(const char*& cursor, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; cursor < end && shift < 64; shift += 7) {
+        unsigned char byte = (unsigned char)*cursor++;
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t zigzag(int64_t value) {
+    return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+// Writes entries[first, last) as an archive file (see ArchiveHeader)
+bool writeArchiveFile(const string& path, const EntryColumns& entries, size_t first, size_t last, uint64_t seq) {
+    vector<uint32_t> order(last - first);
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = uint32_t(first + i);
+    }
+    stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return entries.customerId[a] != entries.customerId[b] ? entries.customerId[a] < entries.customerId[b]
+                                                               : entries.day[a] < entries.day[b];
+    });
+    
+    ArchiveHeader header = {};
+    memcpy(header.magic, "DAIRYARC", 8);
+    header.version = ARCHIVE_VERSION;
+    header.blockCount = uint32_t((order.size() + ARCHIVE_BLOCK_ENTRIES - 1) / ARCHIVE_BLOCK_ENTRIES);
+    header.journalSeq = seq;
+    header.entryCount = order.size();
+    
+    vector<ArchiveBlock> index(header.blockCount);
+    string blocks;
+    uint64_t offset = sizeof(header) + index.size() * sizeof(ArchiveBlock);
+    for (size_t b = 0; b < index.size(); ++b) {
+        size_t begin = b * ARCHIVE_BLOCK_ENTRIES;
+        size_t end = min(order.size(), begin + ARCHIVE_BLOCK_ENTRIES);
+        ArchiveBlock& block = index[b];
+        block.minCustomerId = entries.customerId[order[begin]];
+        block.maxCustomerId = entries.customerId[order[end - 1]];
+        block.minDay = numeric_limits<int32_t>::max();
+        block.maxDay = numeric_limits<int32_t>::min();
+        for (size_t i = begin; i < end; ++i) {
+            block.minDay = min(block.minDay, entries.day[order[i]]);
+            block.maxDay = max(block.maxDay, entries.day[order[i]]);
+        }
+        
+        size_t start = blocks.size();
+        int32_t previousCustomer = block.minCustomerId;
+        int32_t previousDay = block.minDay;
+        for (size_t i = begin; i < end; ++i) {
+            MilkEntry entry = entries[order[i]];
+            if (entry.customerId != previousCustomer) {
+                previousDay = block.minDay;
+            }
+            putVarint(blocks, uint32_t(entry.customerId - previousCustomer));
+            putVarint(blocks, uint32_t(entry.day - previousDay));
+            putVarint(blocks, zigzag(entry.morningMl));
+            putVarint(blocks, zigzag(entry.eveningMl));
+            putVarint(blocks, zigzag(entry.amountPaise));
+            previousCustomer = entry.customerId;
+            previousDay = entry.day;
+        }
+        blocks.append((8 - (blocks.size() - start) % 8) % 8, '\0');
+        
+        block.entryCount = uint32_t(end - begin);
+        block.bytes = uint32_t(blocks.size() - start);
+        block.offset = offset + start;
+        block.checksum = snapshotChecksum(0xcbf29ce484222325ULL, blocks.data() + start, block.bytes);
+    }
+    
+    string tempPath = path + ".tmp";
+    FILE* file = fopen(tempPath.c_str(), "wb");
+    if (!file) {
+        cout << "Error saving " << path << "!\n";
+        return false;
+    }
+    StatTimer timer(STAT_FILE_WRITE);
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(index.data(), sizeof(ArchiveBlock), index.size(), file) == index.size() &&
+              fwrite(blocks.data(), 1, blocks.size(), file) == blocks.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok || !replaceFile(tempPath, path)) {
+        cout << "Error saving " << path << "!\n";
+        remove(tempPath.c_str());
+        return false;
+    }
+    countStat(STAT_BYTES_WRITTEN, offset + blocks.size());
+    return true;
+}
+
+// Appends the rows of an archive file for customerId (or ALL_CUSTOMERS)
+// between startDay and endDay, in customer and date order. Blocks whose
+// bounds rule them out are not read. With endDay < startDay only the header
+// is checked. Returns false if the file is missing or damaged.
+bool readArchiveFile(const string& path, int32_t customerId, int startDay, int endDay, 
+                     vector<MilkEntry>& rows, uint64_t& seq) {
+    StatTimer timer(STAT_ARCHIVE_READ);
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    ArchiveHeader header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, "DAIRYARC", 8) == 0 &&
+              header.version == ARCHIVE_VERSION;
+    vector<ArchiveBlock> index(ok ? header.blockCount : 0);
+    ok = ok && fread(index.data(), sizeof(ArchiveBlock), index.size(), file) == index.size();
+    seq = ok ? header.journalSeq : 0;
+    countStat(STAT_BYTES_READ, sizeof(header) + index.size() * sizeof(ArchiveBlock));
+    
+    string packed;
+    for (size_t b = 0; ok && b < index.size() && startDay <= endDay; ++b) {
+        const ArchiveBlock& block = index[b];
+        if (block.maxDay < startDay || block.minDay > endDay ||
+            (customerId != ALL_CUSTOMERS && (customerId < block.minCustomerId || customerId > block.maxCustomerId))) {
+            continue;
+        }
+        packed.resize(block.bytes);
+        ok = block.bytes % 8 == 0 && fseek(file, long(block.offset), SEEK_SET) == 0 &&
+             fread(&packed[0], 1, packed.size(), file) == packed.size() &&
+             snapshotChecksum(0xcbf29ce484222325ULL, packed.data(), packed.size()) == block.checksum;
+        countStat(STAT_BYTES_READ, packed.size());
+        
+        const char* cursor = packed.data();
+        const char* end = cursor + packed.size();
+        int32_t previousCustomer = block.minCustomerId;
+        int32_t previousDay = block.minDay;
+        for (uint32_t i = 0; ok && i < block.entryCount; ++i) {
+            uint64_t customerStep = 0, dayStep = 0, morning = 0, evening = 0, amount = 0;
+            ok = getVarint(cursor, end, customerStep) && getVarint(cursor, end, dayStep) &&
+                 getVarint(cursor, end, morning) && getVarint(cursor, end, evening) && getVarint(cursor, end, amount);
+            if (!ok) {
+                break;
+            }
+            MilkEntry entry;
+            entry.customerId = int32_t(previousCustomer + customerStep);
+            entry.day = int32_t((customerStep != 0 ? block.minDay : previousDay) + dayStep);
+            entry.morningMl = int32_t(unzigzag(morning));
+            entry.eveningMl = int32_t(unzigzag(evening));
+            entry.amountPaise = int32_t(unzigzag(amount));
+            previousCustomer = entry.customerId;
+            previousDay = entry.day;
+            if ((customerId == ALL_CUSTOMERS || entry.customerId == customerId) &&
+                entry.day >= startDay && entry.day <= endDay) {
+                rows.push_back(entry);
+            }
+        }
+    }
+    fclose(file);
+    if (!ok) {
+        cout << "Warning: " << path << " is damaged!\n";
+    }
+    return ok;
+}
+
+// Reads a whole file in large blocks; false if it cannot be opened
+bool readFile(const string& path, string& contents) {
+    ifstream in(path, ios::binary);
+    if (!in) {
+        return false;
+    }
+    
+    const size_t blockSize = 1 << 22;
+    contents.clear();
+    in.seekg(0, ios::end);
+    streamoff size = in.tellg();
+    in.seekg(0);
+    if (size > 0) {
+        contents.reserve(size_t(size));
+    }
+    
+    size_t length = 0;
+    while (in) {
+        contents.resize(length + blockSize);
+        in.read(&contents[length], blockSize);
+        length += size_t(in.gcount());
+    }
+    contents.resize(length);
+    countStat(STAT_BYTES_READ, length);
+    return true;
+}
+
+// Splits a line on commas into views of the line. Returns the field count;
+// anything above maxFields - 1 comes back as maxFields.
+size_t splitCsvLine(string_view line, string_view* fields, size_t maxFields) {
+    size_t count = 0;
+    size_t start = 0;
+    while (count < maxFields) {
+        size_t comma = line.find(',', start);
+        if (comma == string_view::npos) {
+            fields[count++] = line.substr(start);
+            return count;
+        }
+        fields[count++] = line.substr(start, comma - start);
+        start = comma + 1;
+    }
+    return maxFields;
+}
+
+bool parseInt(string_view text, int32_t& value) {
+    auto result = from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == errc() && result.ptr == text.data() + text.size() && !text.empty();
+}
+
+bool parseDouble(string_view text, double& value) {
+    auto result = from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == errc() && result.ptr == text.data() + text.size() && !text.empty();
+}
+
+// Parses a decimal such as "3.5" as a fixed-point integer with the given number
+// of decimals (3500 for 3 decimals), rounding any extra digits
+bool parseFixed(string_view text, int decimals, int32_t& value) {
+    size_t i = 0;
+    bool negative = !text.empty() && text[0] == '-';
+    i += negative;
+    
+    long long result = 0;
+    int fractionDigits = -1;
+    bool roundUp = false;
+    bool anyDigit = false;
+    for (; i < text.size(); ++i) {
+        char c = text[i];
+        if (c == '.' && fractionDigits < 0) {
+            fractionDigits = 0;
+        } else if (c >= '0' && c <= '9') {
+            anyDigit = true;
+            if (fractionDigits < 0 || fractionDigits < decimals) {
+                result = result * 10 + (c - '0');
+                if (result > INT32_MAX) {
+                    break;
+                }
+                fractionDigits += fractionDigits >= 0;
+            } else if (fractionDigits == decimals) {
+                roundUp = c >= '5';
+                ++fractionDigits;
+            }
+        } else {
+            break;
+        }
+    }
+    
+    if (i != text.size() || !anyDigit) {
+        // Exponent notation and other oddities written by older builds
+        double parsed;
+        if (!parseDouble(text, parsed)) {
+            return false;
+        }
+        double scaled = parsed * pow(10.0, decimals);
+        if (!(fabs(scaled) <= INT32_MAX)) {
+            return false;
+        }
+        value = int32_t(llround(scaled));
+        return true;
+    }
+    
+    for (int d = max(fractionDigits, 0); d < decimals; ++d) {
+        result *= 10;
+    }
+    result += roundUp;
+    if (result > INT32_MAX) {
+        return false;
+    }
+    value = int32_t(negative ? -result : result);
+    return true;
+}
+
+// Parses a "customerId,DD-MM-YYYY,morning,evening" line; the amount is left
+// for the caller to price. Returns the reason the line is invalid, or nullptr.
+const char* parseEntryLine(string_view line, MilkEntry& entry) {
+    string_view fields[5];
+    if (splitCsvLine(line, fields, 5) != 4) {
+        return "expected 4 fields";
+    }
+    if (!parseInt(fields[0], entry.customerId)) {
+        return "bad customer ID";
+    }
+    if ((entry.day = parseDate(fields[1])) < 0) {
+        return "bad date";
+    }
+    if (!parseFixed(fields[2], 3, entry.morningMl) || !parseFixed(fields[3], 3, entry.eveningMl)
+        || entry.morningMl < 0 || entry.eveningMl < 0) {
+        return "bad quantity";
+    }
+    entry.amountPaise = 0;
+    return nullptr;
+}
+
+// Bulk load of "customerId,date,morning,evening" readings (liters) exported
+// by the collection-centre analysers. A header row is allowed. Valid rows are
+// priced at the customer's rate and stored as one batch; the rest are
+// reported by line number.
+int ingestFile(const string& path) {
+    string contents;
+    if (!readFile(path, contents)) {
+        cout << "Cannot read " << path << "!\n";
+        return 1;
+    }
+    
+    clock_t started = clock();
+    vector<MilkEntry> batch;
+    vector<pair<size_t, string>> rejects;
+    batch.reserve(contents.size() / 24);
+    
+    size_t lineNumber = 0;
+    size_t pos = 0;
+    while (pos < contents.size()) {
+        size_t newline = contents.find('\n', pos);
+        if (newline == string::npos) {
+            newline = contents.size();
+        }
+        string_view line(contents.data() + pos, newline - pos);
+        pos = newline + 1;
+        ++lineNumber;
+        
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        
+        MilkEntry entry;
+        const Customer* customer = nullptr;
+        const char* reason = parseEntryLine(line, entry);
+        if (reason && lineNumber == 1 && strcmp(reason, "bad customer ID") == 0) {
+            continue; // header row
+        }
+        if (!reason && !(customer = findCustomer(entry.customerId))) {
+            reason = "unknown customer";
+        }
+        
+        if (reason) {
+            rejects.emplace_back(lineNumber, reason);
+            continue;
+        }
+        entry.amountPaise = calculateAmount(entry.totalMl(), rateOn(*customer, entry.day));
+        batch.push_back(entry);
+    }
+    
+    insertMilkEntries(batch);
+    bool saved = true;
+    if (int(batch.size()) >= checkpointEvery) {
+        // A batch this big would trigger a checkpoint anyway; skip journalling
+        // it unless the save fails, then journal it under the same numbers
+        journalSeq += batch.size();
+        if (!checkpoint()) {
+            journalSeq -= batch.size();
+            journalEntries(batch);
+            saved = false;
+        }
+    } else {
+        journalEntries(batch);
+    }
+    double seconds = double(clock() - started) / CLOCKS_PER_SEC;
+    
+    long long totalMl = 0, totalPaise = 0;
+    for (const auto& entry : batch) {
+        totalMl += entry.totalMl();
+        totalPaise += entry.amountPaise;
+    }
+    
+    reportMalformedLines(path, rejects);
+    cout << "Ingested " << batch.size() << " entries (" << fixed << setprecision(2) 
+         << toLiters(totalMl) << " liters, Rs. " << toRupees(totalPaise) << "), " 
+         << rejects.size() << " rejected, in " << setprecision(3) << seconds << " s\n";
+    
+    if (journalFile) {
+        syncFile(journalFile);
+    }
+    if (!saved) {
+        return 1;
+    }
+    return rejects.empty() ? 0 : 2;
+}
+
+// Month-end run: writes the bill file "Save this bill" would produce for every
+// customer with entries in the period, plus one ledger. The period's slice is
+// grouped by customer in a single counting pass, then worker threads take
+// customers off a shared counter and render their bills independently.
+int billAll(const string& startDate, const string& endDate, unsigned threadCount) {
+    int startDay = parseDate(startDate);
+    int endDay = parseDate(endDate);
+    if (startDay < 0 || endDay < 0) {
+        cout << "Invalid date! Use DD-MM-YYYY.\n";
+        return 1;
+    }
+    
+    // Group the slice's row numbers by customer position, keeping date order
+    loadPartitions(startDay, endDay);
+    auto range = entriesBetween(startDay, endDay);
+    vector<size_t> groupStart(customers.size() + 1, 0);
+    for (size_t i = range.first; i < range.second; ++i) {
+        auto pos = customerIndex.find(milkEntries.customerId[i]);
+        if (pos != customerIndex.end() && !isDeleted(pos->first)) {
+            groupStart[pos->second + 1]++;
+        }
+    }
+    for (size_t c = 0; c < customers.size(); ++c) {
+        groupStart[c + 1] += groupStart[c];
+    }
+    vector<size_t> rows(groupStart.back());
+    vector<size_t> fill(groupStart.begin(), groupStart.end() - 1);
+    for (size_t i = range.first; i < range.second; ++i) {
+        auto pos = customerIndex.find(milkEntries.customerId[i]);
+        if (pos != customerIndex.end() && !isDeleted(pos->first)) {
+            rows[fill[pos->second]++] = i;
+        }
+    }
+    
+    struct BillSummary {
+        long long entries = 0;
+        long long totalMl = 0;
+        long long totalPaise = 0;
+        bool saved = false;
+    };
+    vector<BillSummary> summaries(customers.size());
+    atomic<size_t> nextCustomer(0);
+    
+    // Bills are written in parallel, so no two may share a file; names are
+    // compared without case for case-insensitive file systems
+    unordered_map<string, size_t> billFiles;
+    for (size_t c = 0; c < customers.size(); ++c) {
+        if (groupStart[c] == groupStart[c + 1]) {
+            continue;
+        }
+        string name = billFileName(customers[c], startDate, endDate);
+        transform(name.begin(), name.end(), name.begin(), [](unsigned char ch) { return char(tolower(ch)); });
+        auto inserted = billFiles.emplace(name, c);
+        if (!inserted.second) {
+            cout << "Bills of customers " << customers[inserted.first->second].id << " and " << customers[c].id 
+                 << " would both be saved as " << billFileName(customers[c], startDate, endDate) << "; nothing written.\n";
+            return 1;
+        }
+    }
+    
+    // Each bill is written straight from the customer's row numbers
+    auto worker = [&]() {
+        size_t c;
+        while ((c = nextCustomer.fetch_add(1)) < customers.size()) {
+            if (groupStart[c] == groupStart[c + 1]) {
+                continue;
+            }
+            
+            StatTimer timer(STAT_BILL);
+            BillSummary& summary = summaries[c];
+            summary.entries = (long long)(groupStart[c + 1] - groupStart[c]);
+            for (size_t r = groupStart[c]; r < groupStart[c + 1]; ++r) {
+                summary.totalMl += milkEntries.morningMl[rows[r]] + milkEntries.eveningMl[rows[r]];
+                summary.totalPaise += milkEntries.amountPaise[rows[r]];
+            }
+            
+            ofstream outFile(billFileName(customers[c], startDate, endDate));
+            if (outFile) {
+                ReportWriter out(outFile);
+                writeBillHeader(out, customers[c], startDate, endDate);
+                for (size_t r = groupStart[c]; r < groupStart[c + 1]; ++r) {
+                    writeBillRow(out, milkEntries[rows[r]]);
+                }
+                writeBillFooter(out, summary.totalMl, summary.totalPaise);
+                out.flush();
+                countStat(STAT_BYTES_WRITTEN, uint64_t(outFile.tellp()));
+                summary.saved = bool(outFile);
+            }
+        }
+    };
+    
+    vector<thread> workers;
+    for (unsigned t = 1; t < threadCount; ++t) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : workers) {
+        t.join();
+    }
+    
+    string ledgerName = "Ledger_" + startDate + "_to_" + endDate + ".txt";
+    ofstream ledger(ledgerName);
+    if (!ledger) {
+        cout << "Error saving ledger to file!\n";
+        return 1;
+    }
+    
+    ReportWriter out(ledger);
+    out.text("============================================================================\n");
+    out.text("                          MILK DAIRY LEDGER                                 \n");
+    out.text("============================================================================\n");
+    out.text("Bill Period: ").text(startDate).text(" to ").text(endDate).endLine();
+    out.text("----------------------------------------------------------------------------\n");
+    out.cell("ID", 8).cell("Name", 25).cell("Entries", 10).cell("Total (L)", 14).cell("Amount", 14).text("Bill File").endLine();
+    out.text("----------------------------------------------------------------------------\n");
+    
+    long long billed = 0, failed = 0, totalMl = 0, totalPaise = 0;
+    for (size_t c = 0; c < customers.size(); ++c) {
+        const BillSummary& summary = summaries[c];
+        if (summary.entries == 0) {
+            continue;
+        }
+        out.cell(customers[c].id, 8).cell(customers[c].name, 25).cell(summary.entries, 10)
+           .liters(summary.totalMl, 14).rupees(summary.totalPaise, 14)
+           .text(summary.saved ? billFileName(customers[c], startDate, endDate) : "(not saved)").endLine();
+        ++billed;
+        failed += !summary.saved;
+        totalMl += summary.totalMl;
+        totalPaise += summary.totalPaise;
+    }
+    
+    out.text("----------------------------------------------------------------------------\n");
+    out.cell("Total", 33).cell(billed, 10).liters(totalMl, 14).rupees(totalPaise, 14).endLine();
+    out.text("============================================================================\n");
+    out.flush();
+    ledger.close();
+    
+    cout << "Billed " << billed << " customers for " << startDate << " to " << endDate << ": " 
+         << fixed << setprecision(2) << toLiters(totalMl) << " liters, Rs. " << toRupees(totalPaise) << "\n";
+    cout << "Ledger saved to file: " << ledgerName << "\n";
+    if (failed > 0) {
+        cout << "Error saving " << failed << " bill file(s)!\n";
+        return 1;
+    }
+    return 0;
+}
+
+// Analytics engine. Each thread sums its share of the rows into a table of
+// its own, and the tables are merged at the end. Rows come in date order, so
+// a share is a run of months: within a month the thread sums into an array
+// indexed by customer ID and moves the slots it touched into its table when
+// the month ends, so the hash table sees one update per customer per month.
+static void aggregateSlice(const EntryColumns& store, size_t first, size_t last, size_t idLimit, GroupTotals& groups) {
+    vector<EntryTotals> slots(idLimit);
+    vector<int32_t> touched;
+    int month = 0;
+    int nextMonthDay = numeric_limits<int>::min();
+    auto moveSlots = [&]() {
+        for (int32_t id : touched) {
+            groups[uint64_t(uint32_t(id)) << 32 | uint32_t(month)].add(slots[id]);
+            slots[id] = EntryTotals();
+        }
+        touched.clear();
+    };
+    
+    for (size_t i = first; i < last; ++i) {
+        if (store.day[i] >= nextMonthDay) {
+            moveSlots();
+            month = monthOf(store.day[i]);
+            nextMonthDay = firstDayOfMonth(month + 1);
+        }
+        MilkEntry entry = store[i];
+        if (uint32_t(entry.customerId) < idLimit) {
+            EntryTotals& slot = slots[entry.customerId];
+            if (slot.count == 0) {
+                touched.push_back(entry.customerId);
+            }
+            slot.add(entry);
+        } else {
+            groups[uint64_t(uint32_t(entry.customerId)) << 32 | uint32_t(month)].add(entry);
+        }
+    }
+    moveSlots();
+}
+
+// Groups the entries between startDay and endDay by customer and month.
+// Months that are not resident are read one at a time, as in scanEntries.
+GroupTotals aggregateEntries(int startDay, int endDay, unsigned threadCount) {
+    StatTimer timer(STAT_ANALYTICS);
+    int32_t maxId = 0;
+    for (const auto& customer : customers) {
+        maxId = max(maxId, customer.id);
+    }
+    size_t idLimit = size_t(maxId) + 1;
+    
+    vector<GroupTotals> partials(threadCount);
+    auto aggregate = [&](const EntryColumns& store, size_t first, size_t last) {
+        vector<thread> workers;
+        for (unsigned t = 0; t < threadCount; ++t) {
+            size_t begin = first + (last - first) * t / threadCount;
+            size_t end = first + (last - first) * (t + 1) / threadCount;
+            if (t + 1 < threadCount) {
+                workers.emplace_back(aggregateSlice, cref(store), begin, end, idLimit, ref(partials[t]));
+            } else {
+                aggregateSlice(store, begin, end, idLimit, partials[t]);
+            }
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    };
+    
+    startDay = max(0, startDay);
+    endDay = min(endDay, LAST_DAY);
+    if (!partitionsEnabled) {
+        auto range = entriesBetween(startDay, endDay);
+        aggregate(milkEntries, range.first, range.second);
+    } else {
+        vector<MilkEntry> rows;
+        EntryColumns monthRows;
+        auto last = partitions.upper_bound(monthOf(endDay));
+        for (auto it = partitions.lower_bound(monthOf(startDay)); it != last && startDay <= endDay; ++it) {
+            int from = max(startDay, firstDayOfMonth(it->first));
+            int to = min(endDay, firstDayOfMonth(it->first + 1) - 1);
+            if (it->second.resident || !it->second.onDisk) {
+                auto range = entriesBetween(from, to);
+                aggregate(milkEntries, range.first, range.second);
+                continue;
+            }
+            rows.clear();
+            uint64_t seq;
+            if (it->second.archived) {
+                readArchiveFile(partitionPath(it->first, true), ALL_CUSTOMERS, from, to, rows, seq);
+            } else {
+                readEntryFile(partitionPath(it->first), rows, seq);
+                rows.erase(remove_if(rows.begin(), rows.end(), [&](const MilkEntry& entry) {
+                    return entry.day < from || entry.day > to;
+                }), rows.end());
+            }
+            repriceStaleRows(rows, seq);
+            monthRows.assign(rows);
+            aggregate(monthRows, 0, monthRows.size());
+        }
+    }
+    
+    GroupTotals groups = move(partials[0]);
+    for (unsigned t = 1; t < threadCount; ++t) {
+        for (const auto& group : partials[t]) {
+            groups[group.first].add(group.second);
+        }
+    }
+    for (auto it = groups.begin(); it != groups.end();) {
+        it = isDeleted(int32_t(it->first >> 32)) ? groups.erase(it) : next(it);
+    }
+    return groups;
+}
+
+// The analytics report: litres and payout by month with the shifts apart,
+// the top suppliers by litres, and every customer's months
+int runAnalytics(const string& startDate, const string& endDate, size_t topCount, unsigned threadCount) {
+    int startDay = parseDate(startDate);
+    int endDay = parseDate(endDate);
+    if (startDay < 0 || endDay < 0) {
+        cout << "Invalid date! Use DD-MM-YYYY.\n";
+        return 1;
+    }
+    
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    GroupTotals groups = aggregateEntries(startDay, endDay, threadCount);
+    double millis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    if (groups.empty()) {
+        cout << "\nNo entries found between " << startDate << " and " << endDate << "!\n";
+        return 0;
+    }
+    
+    // Roll the groups up by month and by customer, and sort them for listing
+    map<int, EntryTotals> byMonth;
+    unordered_map<int32_t, EntryTotals> byCustomer;
+    vector<pair<uint64_t, EntryTotals>> sorted(groups.begin(), groups.end());
+    sort(sorted.begin(), sorted.end(), [](const pair<uint64_t, EntryTotals>& a, const pair<uint64_t, EntryTotals>& b) {
+        return a.first < b.first;
+    });
+    EntryTotals overall;
+    for (const auto& group : sorted) {
+        byMonth[int(uint32_t(group.first))].add(group.second);
+        byCustomer[int32_t(group.first >> 32)].add(group.second);
+        overall.add(group.second);
+    }
+    vector<pair<int32_t, EntryTotals>> suppliers(byCustomer.begin(), byCustomer.end());
+    topCount = min(topCount, suppliers.size());
+    partial_sort(suppliers.begin(), suppliers.begin() + topCount, suppliers.end(),
+                 [](const pair<int32_t, EntryTotals>& a, const pair<int32_t, EntryTotals>& b) {
+                     return a.second.totalMl() != b.second.totalMl() ? a.second.totalMl() > b.second.totalMl() 
+                                                                     : a.first < b.first;
+                 });
+    auto customerName = [](int32_t id) {
+        const Customer* customer = findCustomer(id);
+        return customer ? string_view(customer->name) : string_view("Unknown");
+    };
+    auto monthName = [](int month) { return formatDate(firstDayOfMonth(month)).substr(3); };
+    
+    ReportWriter out(cout);
+    out.text("\n--- Analytics ").text(startDate).text(" to ").text(endDate).text(" ---\n");
+    out.text("\nMonthly totals by shift\n");
+    out.text("----------------------------------------------------------------------------\n");
+    out.cell("Month", 10).cell("Entries", 10).cell("Morning", 12).cell("Evening", 12).cell("Morning %", 10)
+       .cell("Total", 12).cell("Amount", 12).endLine();
+    out.text("----------------------------------------------------------------------------\n");
+    for (const auto& month : byMonth) {
+        const EntryTotals& totals = month.second;
+        long long share = totals.totalMl() > 0 ? (totals.morningMl * 1000 + totals.totalMl() / 2) / totals.totalMl() : 0;
+        out.cell(monthName(month.first), 10).cell(totals.count, 10).liters(totals.morningMl, 12)
+           .liters(totals.eveningMl, 12).fixedPoint(share, 1, 10).liters(totals.totalMl(), 12)
+           .rupees(totals.amountPaise, 12).endLine();
+    }
+    out.text("----------------------------------------------------------------------------\n");
+    out.cell("Total", 10).cell(overall.count, 10).liters(overall.morningMl, 12).liters(overall.eveningMl, 12)
+       .cell("", 10).liters(overall.totalMl(), 12).rupees(overall.amountPaise, 12).endLine();
+    
+    out.text("\nTop ").cell((long long)topCount, 0).text(" suppliers by quantity\n");
+    out.text("----------------------------------------------------------------------------\n");
+    out.cell("Rank", 6).cell("ID", 8).cell("Name", 25).cell("Entries", 10).cell("Total (L)", 14).cell("Amount", 12).endLine();
+    out.text("----------------------------------------------------------------------------\n");
+    for (size_t i = 0; i < topCount; ++i) {
+        const EntryTotals& totals = suppliers[i].second;
+        out.cell((long long)i + 1, 6).cell(suppliers[i].first, 8).cell(customerName(suppliers[i].first), 25)
+           .cell(totals.count, 10).liters(totals.totalMl(), 14).rupees(totals.amountPaise, 12).endLine();
+    }
+    
+    out.text("\nCustomers by month\n");
+    out.text("----------------------------------------------------------------------------\n");
+    out.cell("ID", 8).cell("Name", 20).cell("Month", 10).cell("Morning", 10).cell("Evening", 10)
+       .cell("Total", 10).cell("Amount", 12).endLine();
+    out.text("----------------------------------------------------------------------------\n");
+    for (const auto& group : sorted) {
+        int32_t id = int32_t(group.first >> 32);
+        const EntryTotals& totals = group.second;
+        out.cell(id, 8).cell(customerName(id), 20).cell(monthName(int(uint32_t(group.first))), 10)
+           .liters(totals.morningMl, 10).liters(totals.eveningMl, 10).liters(totals.totalMl(), 10)
+           .rupees(totals.amountPaise, 12).endLine();
+    }
+    out.text("----------------------------------------------------------------------------\n");
+    out.flush();
+    
+    cout << "Aggregated " << overall.count << " entries into " << groups.size() << " groups in " 
+         << fixed << setprecision(1) << millis << " ms with " << threadCount << " thread(s).\n";
+    return 0;
+}
+
+// Script mode: one command per line, for automation. Every command answers
+// with a line starting "OK" (and any result fields) or "ERR reason"; commands
+// that list rows follow the OK line with CSV rows and a line holding ".".
+// Quantities are in liters with 3 decimals, amounts in rupees with 2.
+//
+//   ADD-CUSTOMER name,address,phone,rate            OK id
+//   UPDATE-CUSTOMER id,name,address,phone[,rate[,from]]
+//                                                   OK repriced (empty fields keep the current value)
+//   DELETE-CUSTOMER id                              OK
+//   CUSTOMERS                                       OK count, rows id,name,address,phone,rate
+//   FIND text                                       OK count, rows as CUSTOMERS
+//   ENTRY id,date,morning,evening                   OK amount
+//   DAY date | RANGE start end                      OK, rows id,date,morning,evening,total,amount
+//   SEARCH id | BILL id start end                       and a row total,count,morning,evening,total,amount
+//                                                   DAY, RANGE and SEARCH take an optional "limit [offset]"
+//                                                   and then show only that page of the rows, with a row
+//                                                   page,... totalling them after the total row, and a
+//                                                   row more,next-offset when rows follow
+//   DASHBOARD date [id]                             OK, rows day/month/customer,count,morning,evening,total,amount
+//   STATS                                           OK, the statistics table
+//   SAVE                                            OK
+//   DISCARD                                         OK, then stops, dropping unsaved changes
+//   QUIT                                            OK, then stops (as does the end of input)
+//
+// Blank lines and lines starting with # are skipped. Changes are journaled as
+// in the menu and saved by SAVE or the usual background saves.
+static void writeScriptCustomer(ReportWriter& out, const Customer& customer) {
+    out.cell(customer.id, 0).text(",").text(customer.name).text(",").text(customer.address).text(",")
+       .text(customer.phone).text(",").rate(customer.rate, 0).endLine();
+}
+
+static void writeScriptTotals(ReportWriter& out, const EntryTotals& totals) {
+    out.cell(totals.count, 0).text(",").fixedPoint(totals.morningMl, 3, 0).text(",")
+       .fixedPoint(totals.eveningMl, 3, 0).text(",").fixedPoint(totals.totalMl(), 3, 0).text(",")
+       .rupees(totals.amountPaise, 0).endLine();
+}
+
+int runScript(istream& in) {
+    ReportWriter out(cout);
+    string line;
+    bool running = true;
+    int failed = 0;
+    while (running && getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        size_t space = line.find(' ');
+        string_view command = string_view(line).substr(0, space);
+        string_view args = space == string::npos ? string_view() : string_view(line).substr(space + 1);
+        string_view fields[6];
+        size_t count = 0;
+        const char* error = nullptr;
+        
+        // Split on spaces for the query commands, on commas for the rest
+        auto splitWords = [&]() {
+            count = 0;
+            string_view rest = args;
+            while (!rest.empty() && count < 6) {
+                size_t next = rest.find(' ');
+                fields[count++] = rest.substr(0, next);
+                rest = next == string_view::npos ? string_view() : rest.substr(next + 1);
+            }
+            return rest.empty() ? count : size_t(7);
+        };
+        auto customerField = [](string_view text) -> Customer* {
+            int32_t id;
+            return parseInt(text, id) ? findCustomer(id) : nullptr;
+        };
+        // Optional trailing "limit [offset]" fields, from fields[first] on
+        auto pageFields = [&](size_t first, EntryPage& page) {
+            int32_t limit = 0, offset = 0;
+            if (count > first && (!parseInt(fields[first], limit) || limit <= 0)) {
+                return false;
+            }
+            if (count > first + 1 && (!parseInt(fields[first + 1], offset) || offset < 0)) {
+                return false;
+            }
+            if (limit > 0) {
+                page.limit = size_t(limit);
+            }
+            page.offset = size_t(offset);
+            return true;
+        };
+        // Rows stream out as they are scanned; the totals row comes last
+        auto rowsForRange = [&](int startDay, int endDay, int32_t customerId, EntryPage page) {
+            EntryTotals shown;
+            out.text("OK").endLine();
+            scanPage(startDay, endDay, customerId, page, shown, [&](const MilkEntry& entry) {
+                out.cell(entry.customerId, 0).text(",").date(entry.day, 0).text(",")
+                   .fixedPoint(entry.morningMl, 3, 0).text(",").fixedPoint(entry.eveningMl, 3, 0).text(",")
+                   .fixedPoint(entry.totalMl(), 3, 0).text(",").rupees(entry.amountPaise, 0).endLine();
+            });
+            out.text("total,");
+            writeScriptTotals(out, page.total);
+            if (showsPart(page)) {
+                out.text("page,");
+                writeScriptTotals(out, shown);
+            }
+            if (page.more) {
+                out.text("more,").cell((long long)(page.offset + page.limit), 0).endLine();
+            }
+            out.text(".\n");
+        };
+        
+        if (command == "ADD-CUSTOMER") {
+            Customer customer;
+            if (splitCsvLine(args, fields, 6) != 4) {
+                error = "wrong number of fields";
+            } else if (!parseDouble(fields[3], customer.rate) || !(customer.rate > 0)) {
+                error = "bad rate";
+            } else {
+                customer.name = fields[0];
+                customer.address = fields[1];
+                customer.phone = fields[2];
+                out.text("OK ").cell(createCustomer(customer), 0).endLine();
+            }
+        } else if (command == "UPDATE-CUSTOMER") {
+            count = splitCsvLine(args, fields, 6);
+            Customer* customer = count >= 4 && count <= 6 ? customerField(fields[0]) : nullptr;
+            double rate = 0;
+            int fromDay = parseDate(getCurrentDate());
+            if (count < 4 || count > 6) {
+                error = "wrong number of fields";
+            } else if (!customer) {
+                error = "unknown customer";
+            } else if (count >= 5 && !fields[4].empty() && (!parseDouble(fields[4], rate) || !(rate > 0))) {
+                error = "bad rate";
+            } else if (count == 6 && !fields[5].empty() && (fromDay = parseDate(fields[5])) < 0) {
+                error = "bad date";
+            } else {
+                Customer updated = *customer;
+                if (!fields[1].empty()) updated.name = fields[1];
+                if (!fields[2].empty()) updated.address = fields[2];
+                if (!fields[3].empty()) updated.phone = fields[3];
+                upsertCustomer(updated);
+                journalCustomer('U', updated);
+                size_t repriced = rate > 0 ? reviseRate(*findCustomer(updated.id), fromDay, rate) : 0;
+                out.text("OK ").cell((long long)repriced, 0).endLine();
+            }
+        } else if (command == "DELETE-CUSTOMER") {
+            if (Customer* customer = customerField(args)) {
+                int id = customer->id;
+                removeCustomer(id);
+                journalRecord("D," + to_string(id));
+                out.text("OK").endLine();
+            } else {
+                error = "unknown customer";
+            }
+        } else if (command == "CUSTOMERS" || command == "FIND") {
+            vector<const Customer*> found;
+            if (command == "FIND") {
+                found = searchCustomers(args, 10);
+            } else {
+                for (const auto& customer : customers) {
+                    if (!isDeleted(customer.id)) {
+                        found.push_back(&customer);
+                    }
+                }
+            }
+            out.text("OK ").cell((long long)found.size(), 0).endLine();
+            for (const Customer* customer : found) {
+                writeScriptCustomer(out, *customer);
+            }
+            out.text(".\n");
+        } else if (command == "ENTRY") {
+            MilkEntry entry;
+            const Customer* customer = nullptr;
+            error = parseEntryLine(args, entry);
+            if (!error && !(customer = findCustomer(entry.customerId))) {
+                error = "unknown customer";
+            }
+            if (!error) {
+                recordMilkEntry(entry, *customer);
+                out.text("OK ").rupees(entry.amountPaise, 0).endLine();
+            }
+        } else if (command == "DAY" || command == "RANGE") {
+            size_t expected = command == "DAY" ? 1 : 2;
+            int startDay = -1, endDay = -1;
+            EntryPage page;
+            if (splitWords() < expected || count > expected + 2) {
+                error = "wrong number of fields";
+            } else if ((startDay = parseDate(fields[0])) < 0 || (endDay = parseDate(fields[expected - 1])) < 0) {
+                error = "bad date";
+            } else if (!pageFields(expected, page)) {
+                error = "bad page";
+            } else {
+                rowsForRange(startDay, endDay, ALL_CUSTOMERS, page);
+            }
+        } else if (command == "SEARCH" || command == "BILL") {
+            size_t expected = command == "SEARCH" ? 1 : 3;
+            size_t paged = command == "SEARCH" ? 2 : 0;
+            const Customer* customer = nullptr;
+            int startDay = 0, endDay = LAST_DAY;
+            EntryPage page;
+            if (splitWords() < expected || count > expected + paged) {
+                error = "wrong number of fields";
+            } else if (!(customer = customerField(fields[0]))) {
+                error = "unknown customer";
+            } else if (expected == 3 && ((startDay = parseDate(fields[1])) < 0 || (endDay = parseDate(fields[2])) < 0)) {
+                error = "bad date";
+            } else if (!pageFields(expected, page)) {
+                error = "bad page";
+            } else {
+                rowsForRange(startDay, endDay, customer->id, page);
+            }
+        } else if (command == "DASHBOARD") {
+            size_t words = splitWords();
+            int day = words >= 1 ? parseDate(fields[0]) : -1;
+            const Customer* customer = nullptr;
+            if (words < 1 || words > 2) {
+                error = "wrong number of fields";
+            } else if (day < 0) {
+                error = "bad date";
+            } else if (words == 2 && !(customer = customerField(fields[1]))) {
+                error = "unknown customer";
+            } else {
+                loadPartitions(firstDayOfMonth(monthOf(day)), day);
+                out.text("OK").endLine();
+                out.text("day,");
+                writeScriptTotals(out, dayTotals(day));
+                out.text("month,");
+                writeScriptTotals(out, monthToDateTotals(day));
+                if (customer) {
+                    out.text("customer,");
+                    writeScriptTotals(out, customerMonthTotals(customer->id, monthOf(day)));
+                }
+                out.text(".\n");
+            }
+        } else if (command == "STATS") {
+            ostringstream table;
+            writeStats(table);
+            out.text("OK").endLine().text(table.str()).text(".\n");
+        } else if (command == "SAVE") {
+            if (checkpoint()) {
+                out.text("OK").endLine();
+            } else {
+                error = "save failed";
+            }
+        } else if (command == "DISCARD") {
+            discardJournal();
+            out.text("OK").endLine();
+            running = false;
+        } else if (command == "QUIT") {
+            out.text("OK").endLine();
+            running = false;
+        } else {
+            error = "unknown command";
+        }
+        
+        if (error) {
+            out.text("ERR ").text(error).endLine();
+            ++failed;
+        }
+        // A caller may wait for each answer before sending the next command
+        out.flush();
+        trimPartitions();
+        backgroundSaveTick();
+    }
+    finishBackgroundSave(true);
+    return failed > 0 ? 1 : 0;
+}
+
+// Server mode: counters connect to a Unix socket and send one request per
+// line. Entry submissions go through a lock-free queue to a single writer
+// thread, which applies and journals everything queued in batches of up to
+// SERVER_BATCH_ENTRIES, so many counters share each write and fsync. Reports
+// are rendered under a shared lock, in parallel with each other and never in
+// the middle of a batch.
+//
+// Both sides hold the lock for a bounded time. A report shows at most
+// SERVER_PAGE_ROWS rows (clients page through the rest), and a batch applies
+// at most SERVER_BATCH_ENTRIES entries before letting waiting reports in.
+// Only the writer loads and drops months, under the exclusive lock, so the
+// store stays within DAIRY_RESIDENT_MONTHS; reports read other months from
+// their files into a buffer of one month (see scanEntries).
+//
+//   ENTRY id,DD-MM-YYYY,morning,evening   OK amount | ERR reason
+//   DAY DD-MM-YYYY [limit [offset]]       report lines, then "."
+//   SEARCH id [limit [offset]]            report lines, then "."
+//   RANGE DD-MM-YYYY DD-MM-YYYY [limit [offset]]
+//                                         report lines, then "."
+//   BILL id DD-MM-YYYY DD-MM-YYYY         report lines, then "."
+//   QUIT
+//
+// A limit asks for one page of the report's rows, starting offset rows in;
+// the report then ends with a line saying which entries it showed and whether
+// more follow. Queries answer "ERR ..." when there is nothing to show. ENTRY
+// lines sent back to back are submitted together and answered in order.
+#ifndef _WIN32
+
+// An entry submission waiting for the writer
+struct PendingEntry {
+    string line;
+    promise<string> reply;
+    future<string> answer;      // the submitter's end of reply
+    PendingEntry* next = nullptr;
+};
+
+// Multi-producer, single-consumer queue. Producers push onto a lock-free
+// stack; the consumer takes the whole stack at once and reverses it, so
+// submissions are applied in arrival order.
+class SubmissionQueue {
+public:
+    // Returns true if the queue was empty, i.e. the consumer may be asleep
+    bool push(PendingEntry* item) {
+        PendingEntry* head = top.load(memory_order_relaxed);
+        do {
+            item->next = head;
+        } while (!top.compare_exchange_weak(head, item, memory_order_release, memory_order_relaxed));
+        return head == nullptr;
+    }
+    
+    bool empty() const { return top.load(memory_order_acquire) == nullptr; }
+    
+    // Takes everything queued, oldest first
+    vector<PendingEntry*> takeAll() {
+        vector<PendingEntry*> items;
+        for (PendingEntry* item = top.exchange(nullptr, memory_order_acquire); item; item = item->next) {
+            items.push_back(item);
+        }
+        reverse(items.begin(), items.end());
+        return items;
+    }
+    
+private:
+    atomic<PendingEntry*> top{nullptr};
+};
+
+const size_t SERVER_PAGE_ROWS = 1000;      // rows in a report when no smaller limit is asked for
+const size_t SERVER_BATCH_ENTRIES = 256;   // entries applied per hold of the exclusive lock
+
+static shared_mutex storeMutex;         // held exclusively by the writer while it applies a batch
+static SubmissionQueue submissions;
+static mutex writerMutex;               // only for putting the writer to sleep and waking it
+static condition_variable writerWake;
+static bool writerStopping = false;
+static atomic<bool> serverStopping(false);
+static mutex clientsMutex;
+static condition_variable clientsDone;
+static unordered_set<int> clientFds;
+
+static void submissionWriter() {
+    while (true) {
+        vector<PendingEntry*> items = submissions.takeAll();
+        if (items.empty()) {
+            unique_lock<mutex> lock(writerMutex);
+            bool woken = writerWake.wait_for(lock, chrono::seconds(1), []() { return !submissions.empty() || writerStopping; });
+            if (writerStopping && submissions.empty()) {
+                return;
+            }
+            if (!woken) {
+                // Idle: collect or start a background save
+                lock.unlock();
+                unique_lock<shared_mutex> storeLock(storeMutex);
+                backgroundSaveTick();
+            }
+            continue;
+        }
+        
+        vector<string> replies(items.size());
+        for (size_t first = 0; first < items.size(); first += SERVER_BATCH_ENTRIES) {
+            size_t last = min(items.size(), first + SERVER_BATCH_ENTRIES);
+            vector<MilkEntry> batch;
+            unique_lock<shared_mutex> lock(storeMutex);
+            partitionsPinned = false;
+            for (size_t i = first; i < last; ++i) {
+                MilkEntry entry;
+                const Customer* customer = nullptr;
+                const char* reason = parseEntryLine(items[i]->line, entry);
+                if (!reason && !(customer = findCustomer(entry.customerId))) {
+                    reason = "unknown customer";
+                }
+                if (reason) {
+                    replies[i] = string("ERR ") + reason + "\n";
+                    continue;
+                }
+                entry.amountPaise = calculateAmount(entry.totalMl(), rateOn(*customer, entry.day));
+                replies[i] = "OK " + formatFixed(entry.amountPaise, 2) + "\n";
+                batch.push_back(entry);
+            }
+            if (!batch.empty()) {
+                insertMilkEntries(batch);
+                journalEntries(batch);
+            }
+            backgroundSaveTick();
+            trimPartitions();
+            partitionsPinned = true;
+            lock.unlock();
+            
+            // A submitter may free its item as soon as it has the reply
+            for (size_t i = first; i < last; ++i) {
+                items[i]->reply.set_value(move(replies[i]));
+            }
+        }
+    }
+}
+
+static void submitEntry(PendingEntry* item) {
+    if (submissions.push(item)) {
+        lock_guard<mutex> lock(writerMutex);
+        writerWake.notify_one();
+    }
+}
+
+// Renders a report request under the shared lock
+static string runQuery(string_view command, string_view args) {
+    string_view fields[5];
+    size_t count = 0;
+    while (!args.empty() && count < 5) {
+        size_t space = args.find(' ');
+        fields[count++] = args.substr(0, space);
+        args = space == string_view::npos ? string_view() : args.substr(space + 1);
+    }
+    if (!args.empty()) {
+        return "ERR bad request\n";
+    }
+    
+    // DAY, SEARCH and RANGE may end with "limit [offset]" to fetch one page
+    size_t queryFields = command == "RANGE" ? 2 : command == "BILL" ? 3 : 1;
+    EntryPage page;
+    page.limit = SERVER_PAGE_ROWS;
+    if (command != "BILL" && count > queryFields) {
+        int32_t limit = 0, offset = 0;
+        if (count > queryFields + 2 || !parseInt(fields[queryFields], limit) || limit <= 0 ||
+            (count > queryFields + 1 && (!parseInt(fields[queryFields + 1], offset) || offset < 0))) {
+            return "ERR bad page\n";
+        }
+        page.limit = min(size_t(limit), SERVER_PAGE_ROWS);
+        page.offset = size_t(offset);
+        count = queryFields;
+    }
+    
+    ReportWriter out;
+    bool found = false;
+    int32_t customerId = 0;
+    {
+        shared_lock<shared_mutex> lock(storeMutex);
+        if (command == "DAY" && count == 1 && parseDate(fields[0]) >= 0) {
+            found = writeDailyEntries(out, parseDate(fields[0]), &page);
+        } else if (command == "RANGE" && count == 2 && parseDate(fields[0]) >= 0 && parseDate(fields[1]) >= 0) {
+            found = writeEntriesBetween(out, parseDate(fields[0]), parseDate(fields[1]), &page);
+        } else if ((command == "SEARCH" && count == 1) || (command == "BILL" && count == 3)) {
+            const Customer* customer = parseInt(fields[0], customerId) ? findCustomer(customerId) : nullptr;
+            if (!customer) {
+                return "ERR unknown customer\n";
+            }
+            if (command == "SEARCH") {
+                found = writeCustomerEntries(out, *customer, &page);
+            } else if (parseDate(fields[1]) >= 0 && parseDate(fields[2]) >= 0) {
+                found = renderBill(out, *customer, parseDate(fields[1]), parseDate(fields[2]));
+            } else {
+                return "ERR bad date\n";
+            }
+        } else {
+            return "ERR bad request\n";
+        }
+    }
+    if (!found) {
+        return "ERR no entries\n";
+    }
+    return string(out.rendered()) + ".\n";
+}
+
+static bool sendAll(int fd, string_view data) {
+    while (!data.empty()) {
+        ssize_t sent = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data.remove_prefix(size_t(sent));
+    }
+    return true;
+}
+
+static void serveConnection(int fd) {
+    string input;
+    char chunk[16384];
+    vector<unique_ptr<PendingEntry>> submitted;
+    string replies;
+    bool open = true;
+    
+    // Answers the submitted entries, in order
+    auto collectReplies = [&]() {
+        for (auto& item : submitted) {
+            replies += item->answer.get();
+        }
+        submitted.clear();
+    };
+    
+    while (open && !serverStopping) {
+        ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            break;
+        }
+        input.append(chunk, size_t(received));
+        
+        size_t start = 0;
+        size_t newline;
+        while (open && (newline = input.find('\n', start)) != string::npos) {
+            string_view line(input.data() + start, newline - start);
+            start = newline + 1;
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            size_t space = line.find(' ');
+            string_view command = line.substr(0, space);
+            string_view args = space == string_view::npos ? string_view() : line.substr(space + 1);
+            
+            if (command == "ENTRY") {
+                submitted.emplace_back(new PendingEntry());
+                submitted.back()->line = string(args);
+                submitted.back()->answer = submitted.back()->reply.get_future();
+                submitEntry(submitted.back().get());
+            } else if (!line.empty()) {
+                collectReplies();
+                if (command == "QUIT") {
+                    open = false;
+                } else {
+                    replies += runQuery(command, args);
+                }
+            }
+        }
+        input.erase(0, start);
+        
+        collectReplies();
+        open = sendAll(fd, replies) && open;
+        replies.clear();
+    }
+    collectReplies();
+    
+    lock_guard<mutex> lock(clientsMutex);
+    clientFds.erase(fd);
+    close(fd);
+    clientsDone.notify_all();
+}
+
+// Serves until SIGINT or SIGTERM, then saves like "Save and Exit"
+int runServer(const string& socketPath) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        cout << "Socket path too long: " << socketPath << "\n";
+        return 1;
+    }
+    memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+    
+    loadDataFromFile();
+    // Reports must not change the store under a shared lock; they read the
+    // months that are not resident from their files
+    partitionsPinned = true;
+    openJournal();
+    
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str());
+    if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 64) < 0) {
+        cout << "Cannot listen on " << socketPath << ": " << strerror(errno) << "\n";
+        if (listener >= 0) {
+            close(listener);
+        }
+        return 1;
+    }
+    
+    struct sigaction action{};
+    action.sa_handler = [](int) { serverStopping = true; };
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    
+    thread writer(submissionWriter);
+    cout << "Serving on " << socketPath << " (Ctrl+C to stop)" << endl;
+    
+    pollfd listening{listener, POLLIN, 0};
+    while (!serverStopping) {
+        if (poll(&listening, 1, 200) <= 0) {
+            continue;
+        }
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            continue;
+        }
+        lock_guard<mutex> lock(clientsMutex);
+        clientFds.insert(client);
+        thread(serveConnection, client).detach();
+    }
+    close(listener);
+    unlink(socketPath.c_str());
+    
+    {
+        unique_lock<mutex> lock(clientsMutex);
+        for (int fd : clientFds) {
+            shutdown(fd, SHUT_RDWR);
+        }
+        clientsDone.wait(lock, []() { return clientFds.empty(); });
+    }
+    {
+        lock_guard<mutex> lock(writerMutex);
+        writerStopping = true;
+    }
+    writerWake.notify_one();
+    writer.join();
+    
+    checkpoint();
+    cout << "Server stopped. Data saved.\n";
+    return 0;
+}
+
+#else
+
+int runServer(const string& socketPath) {
+    cout << "Server mode needs Unix domain sockets; " << socketPath << " cannot be served on this platform.\n";
+    return 1;
+}
+
+#endif
+
+// Empties the in-memory store
+void clearData() {
+    customers.clear();
+    milkEntries.clear();
+    customerIndex.clear();
+    searchWords.clear();
+    searchTrigrams.clear();
+    dailyRollups.clear();
+    customerMonthRollups.clear();
+    deletedCustomers.clear();
+    rateHistory.clear();
+    partitions.clear();
+    journalSeq = 0;
+    lastCustomerId = 0;
+}
+
+// Replaces the store with a reproducible synthetic data set: the same spec and
+// seed give the same data on every platform. Each customer has a usual
+// quantity and buys in the morning, the evening or both.
+void generateDataset(const DatasetSpec& spec) {
+    clearData();
+    
+    mt19937_64 rng(spec.seed);
+    auto unit = [&rng]() { return double(rng() >> 11) * (1.0 / 9007199254740992.0); };
+    
+    enum Shifts { BOTH, MORNING, EVENING };
+    vector<Shifts> shifts(spec.customers);
+    vector<double> usualLiters(spec.customers);
+    customers.reserve(spec.customers);
+    for (int c = 0; c < spec.customers; ++c) {
+        Customer customer;
+        customer.id = c + 1;
+        customer.name = "Customer " + to_string(customer.id);
+        customer.address = "Village " + to_string(customer.id % 50 + 1);
+        customer.phone = to_string(9000000000LL + customer.id);
+        customer.rate = 40 + int(unit() * 41) * 0.5;
+        customers.push_back(customer);
+        
+        double pick = unit();
+        shifts[c] = pick < spec.bothShifts ? BOTH : pick < (1 + spec.bothShifts) / 2 ? MORNING : EVENING;
+        usualLiters[c] = 1 + unit() * 19;
+    }
+    rebuildCustomerIndex();
+    
+    int firstDay = parseDate("01-01-2020");
+    vector<MilkEntry> rows;
+    for (int d = 0; d < spec.days; ++d) {
+        for (int c = 0; c < spec.customers; ++c) {
+            if (spec.maxEntries > 0 && rows.size() >= spec.maxEntries) {
+                break;
+            }
+            if (unit() >= spec.deliveryRate) {
+                continue;
+            }
+            // Quantities vary by up to 15% either way around the usual amount
+            auto quantity = [&]() { return toMillilitres(usualLiters[c] * (0.85 + 0.3 * unit())); };
+            MilkEntry entry;
+            entry.customerId = customers[c].id;
+            entry.day = firstDay + d;
+            entry.morningMl = shifts[c] == EVENING ? 0 : quantity();
+            entry.eveningMl = shifts[c] == MORNING ? 0 : quantity();
+            entry.amountPaise = calculateAmount(entry.totalMl(), customers[c].rate);
+            rows.push_back(entry);
+        }
+    }
+    milkEntries.assign(rows);
+    if (partitionsEnabled) {
+        adoptResidentEntries();
+    }
+    rebuildRollups();
+}
+
+// One JSON line per scenario: throughput in items per second and latency
+// percentiles in milliseconds over the timed runs.
+static void reportBenchmark(const string& scenario, size_t entries, vector<double>& millis, double itemsPerRun, 
+                            const char* unit) {
+    sort(millis.begin(), millis.end());
+    double total = 0;
+    for (double ms : millis) {
+        total += ms;
+    }
+    auto percentile = [&millis](double p) { return millis[min(millis.size() - 1, size_t(p * millis.size()))]; };
+    
+    cout << "{\"scenario\":\"" << scenario << "\",\"entries\":" << entries 
+         << ",\"format\":\"" << (partitionsEnabled ? "partitions" : snapshotEnabled ? "snapshot" : "csv") << "\""
+         << ",\"runs\":" << millis.size() << ",\"unit\":\"" << unit << "\""
+         << fixed << setprecision(3)
+         << ",\"throughput\":" << (total > 0 ? itemsPerRun * millis.size() * 1000 / total : 0.0)
+         << ",\"p50_ms\":" << percentile(0.50) << ",\"p90_ms\":" << percentile(0.90) 
+         << ",\"p99_ms\":" << percentile(0.99) << ",\"max_ms\":" << millis.back() << "}" << endl;
+}
+
+// Times the core operations on generated data sets of 10^3 entries up to
+// maxEntries, in a scratch directory so no real data or journal is touched.
+int runBenchmarks(size_t maxEntries, uint64_t seed) {
+    const filesystem::path scratch = "dairy-bench";
+    if (filesystem::exists(scratch)) {
+        cout << "Benchmark directory " << scratch.string() << " already exists!\n";
+        return 1;
+    }
+    filesystem::create_directory(scratch);
+    const filesystem::path home = filesystem::current_path();
+    filesystem::current_path(scratch);
+    
+    using Clock = chrono::steady_clock;
+    auto elapsedMs = [](Clock::time_point start) {
+        return chrono::duration<double, milli>(Clock::now() - start).count();
+    };
+    
+    ostream discard(nullptr);
+    mt19937_64 rng(seed);
+    
+    for (size_t entries = 1000; entries <= maxEntries; entries *= 10) {
+        DatasetSpec spec;
+        spec.seed = seed;
+        spec.customers = int(max<size_t>(10, entries / 300));
+        spec.days = int(entries / (spec.customers * spec.deliveryRate)) + 2;
+        spec.maxEntries = entries;
+        
+        vector<double> millis;
+        Clock::time_point start = Clock::now();
+        generateDataset(spec);
+        millis.push_back(elapsedMs(start));
+        reportBenchmark("generate", entries, millis, double(entries), "entries");
+        int firstDay = milkEntries.day.front();
+        int dayCount = milkEntries.day.back() - firstDay + 1;
+        
+        const int fileRuns = 3;
+        millis.clear();
+        for (int run = 0; run < fileRuns; ++run) {
+            start = Clock::now();
+            saveDataToFile();
+            millis.push_back(elapsedMs(start));
+        }
+        reportBenchmark("save", entries, millis, double(entries), "entries");
+        
+        millis.clear();
+        for (int run = 0; run < fileRuns; ++run) {
+            clearData();
+            start = Clock::now();
+            loadDataFromFile();
+            millis.push_back(elapsedMs(start));
+        }
+        reportBenchmark("load", entries, millis, double(entries), "entries");
+        
+        auto randomCustomer = [&]() -> const Customer& { return customers[rng() % customers.size()]; };
+        
+        millis.clear();
+        for (int run = 0; run < 200; ++run) {
+            int day = firstDay + int(rng() % dayCount);
+            ReportWriter out(discard);
+            start = Clock::now();
+            writeDailyEntries(out, day);
+            out.flush();
+            millis.push_back(elapsedMs(start));
+        }
+        reportBenchmark("daily-entries", entries, millis, 1, "queries");
+        
+        millis.clear();
+        for (int run = 0; run < 200; ++run) {
+            const Customer& customer = randomCustomer();
+            int startDay = firstDay + int(rng() % dayCount);
+            ReportWriter out(discard);
+            start = Clock::now();
+            renderBill(out, customer, startDay, startDay + 29);
+            out.flush();
+            millis.push_back(elapsedMs(start));
+        }
+        reportBenchmark("bill", entries, millis, 1, "queries");
+        
+        millis.clear();
+        for (int run = 0; run < 20; ++run) {
+            const Customer& customer = randomCustomer();
+            ReportWriter out(discard);
+            start = Clock::now();
+            writeCustomerEntries(out, customer);
+            out.flush();
+            millis.push_back(elapsedMs(start));
+        }
+        reportBenchmark("search-customer", entries, millis, 1, "queries");
+        
+        millis.clear();
+        for (int run = 0; run < 100; ++run) {
+            int startDay = firstDay + int(rng() % dayCount);
+            ReportWriter out(discard);
+            start = Clock::now();
+            writeEntriesBetween(out, startDay, startDay + 6);
+            out.flush();
+            millis.push_back(elapsedMs(start));
+        }
+        reportBenchmark("search-range", entries, millis, 1, "queries");
+        
+        millis.clear();
+        for (int run = 0; run < fileRuns; ++run) {
+            start = Clock::now();
+            aggregateEntries(firstDay, firstDay + dayCount - 1, max(1u, thread::hardware_concurrency()));
+            millis.push_back(elapsedMs(start));
+        }
+        reportBenchmark("analytics", entries, millis, double(entries), "entries");
+        
+        millis.clear();
+        size_t deletions = max<size_t>(1, customers.size() / 10);
+        for (size_t run = 0; run < deletions; ++run) {
+            int id = customers[run * customers.size() / deletions].id;
+            start = Clock::now();
+            removeCustomer(id);
+            millis.push_back(elapsedMs(start));
+        }
+        reportBenchmark("delete-customer", entries, millis, 1, "customers");
+        
+        millis.clear();
+        start = Clock::now();
+        compactDeletedCustomers();
+        millis.push_back(elapsedMs(start));
+        reportBenchmark("compact", entries, millis, double(entries), "entries");
+    }
+    
+    filesystem::current_path(home);
+    filesystem::remove_all(scratch);
+    return 0;
+}
+
+// A thread's hold on its ThreadStats, handed back when the thread exits
+struct ThreadStatsLease {
+    ThreadStats* stats = nullptr;
+    
+    ~ThreadStatsLease() {
+        if (stats) {
+            lock_guard<mutex> lock(statsRegistryMutex);
+            freeThreadStats.push_back(stats);
+        }
+    }
+};
+
+ThreadStats& threadStats() {
+    thread_local ThreadStatsLease lease;
+    if (!lease.stats) {
+        lock_guard<mutex> lock(statsRegistryMutex);
+        if (!freeThreadStats.empty()) {
+            lease.stats = freeThreadStats.back();
+            freeThreadStats.pop_back();
+        } else {
+            statsRegistry.emplace_back(new ThreadStats());
+            lease.stats = statsRegistry.back().get();
+        }
+    }
+    return *lease.stats;
+}
+
+// Counters have a single writer, so a plain load and store is enough
+static inline void bumpStat(atomic<uint64_t>& value, uint64_t amount) {
+    value.store(value.load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+// Buckets 0-3 hold 0-3 ns; above that each power of two is split in four
+static int latencyBucket(uint64_t nanoseconds) {
+    if (nanoseconds < 4) {
+        return int(nanoseconds);
+    }
+    int exponent = 2;
+    while (exponent < 63 && (nanoseconds >> (exponent + 1)) != 0) {
+        ++exponent;
+    }
+    int bucket = (exponent - 1) * 4 + int((nanoseconds >> (exponent - 2)) & 3);
+    return min(bucket, LATENCY_BUCKETS - 1);
+}
+
+// Largest latency that falls in the bucket
+static uint64_t latencyBucketLimit(int bucket) {
+    if (bucket < 4) {
+        return uint64_t(bucket);
+    }
+    int exponent = bucket / 4 + 1;
+    return ((uint64_t(4 + bucket % 4) + 1) << (exponent - 2)) - 1;
+}
+
+void recordLatency(StatOp op, uint64_t nanoseconds) {
+    ThreadStats& stats = threadStats();
+    bumpStat(stats.calls[op], 1);
+    bumpStat(stats.totalNs[op], nanoseconds);
+    bumpStat(stats.latency[op][latencyBucket(nanoseconds)], 1);
+    if (nanoseconds > stats.maxNs[op].load(memory_order_relaxed)) {
+        stats.maxNs[op].store(nanoseconds, memory_order_relaxed);
+    }
+}
+
+void countStat(StatCounter counter, uint64_t amount) {
+    bumpStat(threadStats().counters[counter], amount);
+}
+
+// Sums every thread's counters into one table. Latencies are in microseconds;
+// percentiles are the upper edge of their histogram bucket.
+void writeStats(ostream& sink) {
+    static const char* const opNames[STAT_OPS] = {
+        "load", "save", "file write", "journal write", "entry insert", "daily report",
+        "customer search", "range search", "bill", "rate change", "compact", "partition load",
+        "customer lookup", "archive read", "analytics"
+    };
+    
+    uint64_t calls[STAT_OPS] = {}, totalNs[STAT_OPS] = {}, maxNs[STAT_OPS] = {};
+    uint64_t counters[STAT_COUNTERS] = {};
+    vector<uint64_t> latency(size_t(STAT_OPS) * LATENCY_BUCKETS, 0);
+    {
+        lock_guard<mutex> lock(statsRegistryMutex);
+        for (const auto& stats : statsRegistry) {
+            for (int op = 0; op < STAT_OPS; ++op) {
+                calls[op] += stats->calls[op].load(memory_order_relaxed);
+                totalNs[op] += stats->totalNs[op].load(memory_order_relaxed);
+                maxNs[op] = max(maxNs[op], stats->maxNs[op].load(memory_order_relaxed));
+                for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+                    latency[size_t(op) * LATENCY_BUCKETS + b] += stats->latency[op][b].load(memory_order_relaxed);
+                }
+            }
+            for (int c = 0; c < STAT_COUNTERS; ++c) {
+                counters[c] += stats->counters[c].load(memory_order_relaxed);
+            }
+        }
+    }
+    
+    size_t liveCustomers = customers.size();
+    for (int id : deletedCustomers) {
+        liveCustomers -= customerIndex.count(id);
+    }
+    ReportWriter out(sink);
+    out.text("\n--- Statistics ---\n");
+    out.cell("Customers: ", 20).cell((long long)liveCustomers, 0).endLine();
+    out.cell("Milk entries: ", 20).cell((long long)milkEntries.size(), 0).endLine();
+    out.cell("Entries inserted: ", 20).cell((long long)counters[STAT_ENTRIES_INSERTED], 0).endLine();
+    out.cell("Bytes read: ", 20).cell((long long)counters[STAT_BYTES_READ], 0).endLine();
+    out.cell("Bytes written: ", 20).cell((long long)counters[STAT_BYTES_WRITTEN], 0).endLine();
+    out.cell("Customer text: ", 20).cell((long long)customerText.bytes(), 0).text(" bytes in ")
+       .cell((long long)customerText.values(), 0).text(" values").endLine();
+    out.text("----------------------------------------------------------------------------------------------------\n");
+    out.cell("Operation", 18).cell("Calls", 10, RIGHT).cell("Total ms", 12, RIGHT).cell("Mean us", 12, RIGHT)
+       .cell("p50 us", 12, RIGHT).cell("p90 us", 12, RIGHT).cell("p99 us", 12, RIGHT).cell("Max us", 12, RIGHT).endLine();
+    out.text("----------------------------------------------------------------------------------------------------\n");
+    
+    for (int op = 0; op < STAT_OPS; ++op) {
+        if (calls[op] == 0) {
+            continue;
+        }
+        const uint64_t* buckets = &latency[size_t(op) * LATENCY_BUCKETS];
+        auto percentile = [&](double p) {
+            uint64_t target = max<uint64_t>(1, uint64_t(ceil(p * double(calls[op]))));
+            uint64_t seen = 0;
+            for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+                seen += buckets[b];
+                if (seen >= target) {
+                    return (long long)min(latencyBucketLimit(b), maxNs[op]);
+                }
+            }
+            return (long long)maxNs[op];
+        };
+        
+        out.cell(opNames[op], 18).cell((long long)calls[op], 10, RIGHT)
+           .fixedPoint((long long)(totalNs[op] / 1000), 3, 12, RIGHT)
+           .fixedPoint((long long)(totalNs[op] / calls[op]), 3, 12, RIGHT)
+           .fixedPoint(percentile(0.50), 3, 12, RIGHT).fixedPoint(percentile(0.90), 3, 12, RIGHT)
+           .fixedPoint(percentile(0.99), 3, 12, RIGHT).fixedPoint((long long)maxNs[op], 3, 12, RIGHT).endLine();
+    }
+    out.text("----------------------------------------------------------------------------------------------------\n");
+}
+
+void dumpStatsAtExit() {
+    if (printStatsOnExit) {
+        writeStats(cout);
+    }
+    if (!statsFile.empty()) {
+        ofstream out(statsFile);
+        if (out) {
+            writeStats(out);
+        } else {
+            cout << "Error writing statistics to " << statsFile << "!\n";
+        }
+    }
+}